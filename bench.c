@@ -0,0 +1,1184 @@
+/*** includes ***/
+
+// kiloのベンチマーク (make bench)
+// kilo.cをそのまま取り込み、端末を使わずに編集・検索・保存などの処理を呼んで時間を測る
+// ベンチマークは1つずつfork()した子プロセスで実行するので、前のベンチマークの状態は残らない
+// 使い方: ./kilo-bench [名前...]  (名前を省略すると全部。名前はuser-004のような要望の番号)
+// 入力のファイルはBENCH_DIR (無ければ/tmp) に作り、次からは作ったものを使う
+// BENCH_SCALEで入力の大きさを変えられる (既定は1)
+
+#define _DEFAULT_SOURCE
+#define _BSD_SOURCE
+#define _GNU_SOURCE
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <regex.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <signal.h>
+
+/*** hooks ***/
+
+// kilo.cの中のメモリ確保の回数 (スレッドからも呼ばれるので__atomicで数える)
+long bench_allocs;
+
+void *benchMalloc(size_t n) {
+    __atomic_fetch_add(&bench_allocs, 1, __ATOMIC_RELAXED);
+    return malloc(n);
+}
+
+void *benchRealloc(void *p, size_t n) {
+    __atomic_fetch_add(&bench_allocs, 1, __ATOMIC_RELAXED);
+    return realloc(p, n);
+}
+
+void *benchCalloc(size_t n, size_t size) {
+    __atomic_fetch_add(&bench_allocs, 1, __ATOMIC_RELAXED);
+    return calloc(n, size);
+}
+
+// kilo.cの入力のシステムコールの回数
+long bench_syscalls;
+
+ssize_t benchReadv(int fd, const struct iovec *iov, int cnt) {
+    bench_syscalls++;
+    return readv(fd, iov, cnt);
+}
+
+int benchPoll(struct pollfd *fds, nfds_t n, int timeout) {
+    bench_syscalls++;
+    return poll(fds, n, timeout);
+}
+
+// ジャーナルの書き込みスレッドがfdatasyncした回数
+long bench_syncs;
+
+int benchFdatasync(int fd) {
+    __atomic_fetch_add(&bench_syncs, 1, __ATOMIC_RELAXED);
+    return fdatasync(fd);
+}
+
+// 端末が無くても動くよう、ウィンドウサイズは固定の大きさを返す
+int benchWindowSize(struct winsize *ws) {
+    ws->ws_row = 24;
+    ws->ws_col = 80;
+    return 0;
+}
+
+#define malloc(n) benchMalloc(n)
+#define realloc(p, n) benchRealloc(p, n)
+#define calloc(n, size) benchCalloc(n, size)
+#define readv(fd, iov, cnt) benchReadv(fd, iov, cnt)
+#define poll(fds, n, timeout) benchPoll(fds, n, timeout)
+#define fdatasync(fd) benchFdatasync(fd)
+#define ioctl(fd, req, ws) benchWindowSize(ws)
+#define main kiloMain
+
+#undef _DEFAULT_SOURCE // kilo.cが定義し直す
+#include "kilo.c"
+
+#undef malloc
+#undef realloc
+#undef calloc
+#undef readv
+#undef poll
+#undef fdatasync
+#undef ioctl
+#undef main
+
+/*** bench ***/
+
+double benchNow() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// 入力の大きさの倍率
+double benchScale() {
+    const char *s = getenv("BENCH_SCALE");
+    double scale = s ? atof(s) : 1;
+    return scale > 0 ? scale : 1;
+}
+
+// 入力のファイルを置くディレクトリの中のパス
+char *benchPath(const char *name) {
+    const char *dir = getenv("BENCH_DIR");
+    if (dir == NULL)
+        dir = "/tmp";
+    char *path = malloc(strlen(dir) + strlen(name) + 2);
+    if (path == NULL) die("malloc");
+    sprintf(path, "%s/%s", dir, name);
+    return path;
+}
+
+// 結果を1行表示する。子プロセスから出すのでその都度flushする
+void benchReport(const char *name, const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    printf("%-9s ", name);
+    vprintf(fmt, ap);
+    printf("\n");
+    fflush(stdout);
+    va_end(ap);
+}
+
+// rows行のログのようなファイルのパスを返す (無ければ作る)
+// 10行に1行はERRORの行で "timeout" を含む
+char *benchLogFile(int rows) {
+    char name[64];
+    snprintf(name, sizeof(name), "kilo-bench-log-%d.txt", rows);
+    char *path = benchPath(name);
+    if (access(path, R_OK) == 0)
+        return path;
+
+    char *tmp = benchPath("kilo-bench-log.tmp");
+    FILE *fp = fopen(tmp, "w");
+    if (fp == NULL) die("fopen");
+    int j;
+    for (j = 0; j < rows; j++) {
+        int worker = j * 7 % 16;
+        int ms = j * 37 % 1000;
+        if (j % 10 == 9)
+            fprintf(fp, "2026-10-17 12:%02d:%02d ERROR worker-%d request %d failed: timeout after %d ms\n",
+                j / 60 % 60, j % 60, worker, j, ms);
+        else
+            fprintf(fp, "2026-10-17 12:%02d:%02d INFO worker-%d request %d took %d ms\n",
+                j / 60 % 60, j % 60, worker, j, ms);
+    }
+    if (fclose(fp) == EOF || rename(tmp, path) == -1) die("write");
+    free(tmp);
+    return path;
+}
+
+// ファイルの大きさ
+double benchFileSize(const char *path) {
+    struct stat st;
+    if (stat(path, &st) == -1) die("stat");
+    return st.st_size;
+}
+
+// 常駐しているメモリの大きさ (バイト)
+double benchRss() {
+    long pages = 0, resident = 0;
+    FILE *fp = fopen("/proc/self/statm", "r");
+    if (fp == NULL || fscanf(fp, "%ld %ld", &pages, &resident) != 2) die("statm");
+    fclose(fp);
+    return (double)resident * sysconf(_SC_PAGESIZE);
+}
+
+/*** user-004 ***/
+
+// 1行に10万文字を打つ。最初のkiloと同じく1文字ごとにreallocする場合と比べる
+void benchTypeLine() {
+    int n = 100000 * benchScale();
+
+    double t = benchNow();
+    char *chars = NULL;
+    int size = 0;
+    int j;
+    for (j = 0; j < n; j++) {
+        chars = realloc(chars, size + 2);
+        if (chars == NULL) die("realloc");
+        chars[size++] = 'a' + j % 26;
+        chars[size] = '\0';
+    }
+    t = benchNow() - t;
+    free(chars);
+    benchReport("user-004", "type %d chars, realloc per key:  %8.2f ms  %8d allocs", n, t * 1e3, n);
+
+    long allocs = bench_allocs;
+    t = benchNow();
+    for (j = 0; j < n; j++)
+        editorInsertChar('a' + j % 26);
+    t = benchNow() - t;
+    benchReport("user-004", "type %d chars, editorInsertChar: %8.2f ms  %8ld allocs",
+        n, t * 1e3, bench_allocs - allocs);
+}
+
+/*** user-010 ***/
+
+// 最初のkiloのeditorReadKey。1バイトずつreadする (readの回数をcallsに足す)
+int benchReadKeyBytewise(int fd, long *calls) {
+    char c;
+    (*calls)++;
+    if (read(fd, &c, 1) != 1) die("read");
+    if (c != '\x1b')
+        return c;
+
+    char seq[3];
+    (*calls)++;
+    if (read(fd, &seq[0], 1) != 1) return '\x1b';
+    (*calls)++;
+    if (read(fd, &seq[1], 1) != 1) return '\x1b';
+    if (seq[0] == '[') {
+        if (seq[1] >= '0' && seq[1] <= '9') {
+            (*calls)++;
+            if (read(fd, &seq[2], 1) != 1) return '\x1b';
+            if (seq[2] == '~')
+                return editorCsiKey('~', seq[1] - '0');
+        } else {
+            return editorCsiKey(seq[1], 0);
+        }
+    }
+    return '\x1b';
+}
+
+// 打鍵の列を作る。文字が8割で、残りは矢印キー・Delete・Enter
+char *benchKeyStream(int nkeys, size_t *len) {
+    char *buf = malloc((size_t)nkeys * 4);
+    if (buf == NULL) die("malloc");
+    size_t n = 0;
+    unsigned int seed = 1;
+    int j;
+    for (j = 0; j < nkeys; j++) {
+        seed = seed * 1103515245 + 12345;
+        int r = (seed >> 16) % 100;
+        if (r < 80) {
+            buf[n++] = 'a' + r % 26;
+        } else if (r < 88) {
+            memcpy(&buf[n], "\x1b[", 2);
+            buf[n + 2] = "ABCD"[r % 4];
+            n += 3;
+        } else if (r < 92) {
+            memcpy(&buf[n], "\x1b[3~", 4);
+            n += 4;
+        } else {
+            buf[n++] = '\r';
+        }
+    }
+    *len = n;
+    return buf;
+}
+
+// 同じ打鍵の列をファイルに書いて標準入力にし、editorReadKeyと最初のkiloの読み方で読む
+// (打鍵がまとめて届いている場合。貼り付けや端末の遅れで溜まった入力に相当する)
+void benchReadKeys() {
+    int nkeys = 1000000 * benchScale();
+    size_t len;
+    char *keys = benchKeyStream(nkeys, &len);
+    char *path = benchPath("kilo-bench-keys");
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1 || write(fd, keys, len) != (ssize_t)len) die("write");
+    free(keys);
+    if (dup2(fd, STDIN_FILENO) == -1) die("dup2");
+    close(fd);
+    unlink(path);
+    free(path);
+
+    lseek(STDIN_FILENO, 0, SEEK_SET);
+    long calls = 0;
+    long sum = 0;
+    int j;
+    double t = benchNow();
+    for (j = 0; j < nkeys; j++)
+        sum += benchReadKeyBytewise(STDIN_FILENO, &calls);
+    t = benchNow() - t;
+    benchReport("user-010", "%d keys, read() per byte: %8.2f Mkeys/s  %8ld syscalls (%.2g/key)",
+        nkeys, nkeys / t / 1e6, calls, (double)calls / nkeys);
+
+    lseek(STDIN_FILENO, 0, SEEK_SET);
+    bench_syscalls = 0;
+    t = benchNow();
+    for (j = 0; j < nkeys; j++)
+        sum -= editorReadKey();
+    t = benchNow() - t;
+    benchReport("user-010", "%d keys, editorReadKey:   %8.2f Mkeys/s  %8ld syscalls (%.2g/key)",
+        nkeys, nkeys / t / 1e6, bench_syscalls, (double)bench_syscalls / nkeys);
+    if (sum != 0)
+        benchReport("user-010", "decoded keys differ");
+}
+
+/*** user-013 ***/
+
+// ファイルを開く。mmapして並列に改行を探す今のeditorOpen (benchOpen) と、
+// getlineで1行ずつ読む場合 (mmapできない時の経路で、最初のkiloの読み方) を比べる
+// ファイルはページキャッシュに載っている状態
+void benchOpenGetline() {
+    int rows = 10000000 * benchScale();
+    char *path = benchLogFile(rows);
+    double size = benchFileSize(path);
+
+    double t = benchNow();
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL) die("fopen");
+    char *line = NULL;
+    size_t linecap = 0;
+    ssize_t linelen;
+    while ((linelen = getline(&line, &linecap, fp)) != -1) {
+        while (linelen > 0 && (line[linelen - 1] == '\n' || line[linelen - 1] == '\r'))
+            linelen--;
+        editorInsertRow(E.numrows, line, linelen);
+    }
+    free(line);
+    fclose(fp);
+    t = benchNow() - t;
+    benchReport("user-013", "open %.0f MB (%d rows), getline:    %7.3f s  %6.2f GB/s",
+        size / 1e6, E.numrows, t, size / t / 1e9);
+    free(path);
+}
+
+void benchOpen() {
+    int rows = 10000000 * benchScale();
+    char *path = benchLogFile(rows);
+    double size = benchFileSize(path);
+
+    double t = benchNow();
+    editorOpen(path);
+    t = benchNow() - t;
+    benchReport("user-013", "open %.0f MB (%d rows), editorOpen: %7.3f s  %6.2f GB/s  (%ld cpus)",
+        size / 1e6, E.numrows, t, size / t / 1e9, sysconf(_SC_NPROCESSORS_ONLN));
+    free(path);
+}
+
+/*** user-014 ***/
+
+// 1000万行のログで検索語を1文字ずつ打つ (検索のプロンプトで打った時と同じくeditorFindBuildを呼ぶ)
+void benchIncrementalSearch() {
+    int rows = 10000000 * benchScale();
+    char *path = benchLogFile(rows);
+    editorOpen(path);
+    free(path);
+
+    const char *query = "timeout after 99";
+    char typed[32];
+    int j;
+    for (j = 1; j <= (int)strlen(query); j++) {
+        memcpy(typed, query, j);
+        typed[j] = '\0';
+        double t = benchNow();
+        editorFindBuild(typed);
+        t = benchNow() - t;
+        benchReport("user-014", "%d rows, type %-18s %8.3f ms  %8d matches", E.numrows, typed, t * 1e3, E.find.n);
+    }
+}
+
+/*** user-016 ***/
+
+// 読み込んである行をpatternで全件検索する。regexの検索 (editorFindBuild) と、
+// 同じ行に対して1行ずつPOSIXのregexecを呼ぶ場合を比べる
+void benchRegexRows(const char *what, const char *pattern) {
+    regex_t preg;
+    if (regcomp(&preg, pattern, REG_EXTENDED) != 0) die("regcomp");
+    long n = 0;
+    double t = benchNow();
+    int j;
+    for (j = 0; j < E.numrows; j++) {
+        // 行はNULL文字で終わっていない (mmapしたファイルの中) のでREG_STARTENDで範囲を渡す
+        erow *row = editorRow(j);
+        regmatch_t m;
+        int from = 0;
+        while (from <= row->size) {
+            m.rm_so = from;
+            m.rm_eo = row->size;
+            if (regexec(&preg, row->chars, 1, &m, REG_STARTEND | (from > 0 ? REG_NOTBOL : 0)) != 0)
+                break;
+            n++;
+            from = m.rm_eo > m.rm_so ? m.rm_eo : m.rm_eo + 1;
+        }
+    }
+    t = benchNow() - t;
+    regfree(&preg);
+    benchReport("user-016", "%-22s %-22s regexec:         %8.3f s  %8ld matches", what, pattern, t, n);
+
+    E.find_regex = 1;
+    t = benchNow();
+    editorFindBuild(pattern);
+    t = benchNow() - t;
+    benchReport("user-016", "%-22s %-22s editorFindBuild: %8.3f s  %8d matches", what, pattern, t, E.find.n);
+    editorFindClear();
+}
+
+void benchRegex() {
+    int rows = 1000000 * benchScale();
+    char *path = benchLogFile(rows);
+    char what[64];
+    snprintf(what, sizeof(what), "%d log rows", rows);
+    editorOpen(path);
+    benchRegexRows(what, "ERROR.*timeout");
+    benchRegexRows(what, "request [0-9]+ took 9");
+    free(path);
+}
+
+// 後戻りする実装では遅くなるパターン。x だけの行に (x+x+)+y
+void benchRegexPathological() {
+    int rows = 1000 * benchScale();
+    int len = 1000;
+    char *line = malloc(len);
+    if (line == NULL) die("malloc");
+    memset(line, 'x', len);
+    int j;
+    for (j = 0; j < rows; j++)
+        editorInsertRow(E.numrows, line, len);
+    free(line);
+    char what[64];
+    snprintf(what, sizeof(what), "%d rows of %d x", rows, len);
+    benchRegexRows(what, "(x+x+)+y");
+    benchRegexRows(what, "x|x.*y");
+}
+
+/*** user-017 ***/
+
+// ログの "timeout" (10行に1つ) をすべて置き換える
+void benchReplace() {
+    int rows = 10000000 * benchScale();
+    char *path = benchLogFile(rows);
+    double size = benchFileSize(path);
+    editorOpen(path);
+    free(path);
+
+    int nrows;
+    double t = benchNow();
+    int n = editorReplaceAll("timeout", "deadline", &nrows);
+    t = benchNow() - t;
+    benchReport("user-017", "replace in %.0f MB: %d occurrences in %d rows  %7.3f s",
+        size / 1e6, n, nrows, t);
+
+    t = benchNow();
+    editorUndo();
+    t = benchNow() - t;
+    benchReport("user-017", "undo the replace:                                    %7.3f s", t);
+}
+
+/*** user-019 ***/
+
+int benchIsSeparator(int c) {
+    return isspace(c) || c == '\0' || strchr(",.()+-/*=~%<>[];", c) != NULL;
+}
+
+// 表を使うようにする前のeditorSyntaxScan (区切り文字をstrchrで、キーワードを1つずつstrncmpで調べる)
+int benchSyntaxScanStrchr(const char *s, int len, int in, unsigned char *hl) {
+    struct editorSyntax *syntax = E.syntax;
+    char **keywords = syntax->keywords;
+
+    char *scs = syntax->singleline_comment_start;
+    char *mcs = syntax->multiline_comment_start;
+    char *mce = syntax->multiline_comment_end;
+    int scs_len = scs ? strlen(scs) : 0;
+    int mcs_len = mcs ? strlen(mcs) : 0;
+    int mce_len = mce ? strlen(mce) : 0;
+
+    if (hl)
+        memset(hl, HL_NORMAL, len);
+
+    int prev_sep = 1;
+    int in_string = 0;
+    int in_comment = in;
+
+    int i = 0;
+    while (i < len) {
+        char c = s[i];
+        unsigned char prev_hl = (hl && i > 0) ? hl[i - 1] : HL_NORMAL;
+
+        // 1行コメント
+        if (scs_len && !in_string && !in_comment && len - i >= scs_len &&
+            !strncmp(&s[i], scs, scs_len)) {
+            if (hl) memset(&hl[i], HL_COMMENT, len - i);
+            break;
+        }
+
+        // 複数行コメント
+        if (mcs_len && mce_len && !in_string) {
+            if (in_comment) {
+                if (hl) hl[i] = HL_MLCOMMENT;
+                if (len - i >= mce_len && !strncmp(&s[i], mce, mce_len)) {
+                    if (hl) memset(&hl[i], HL_MLCOMMENT, mce_len);
+                    i += mce_len;
+                    in_comment = 0;
+                    prev_sep = 1;
+                } else {
+                    i++;
+                }
+                continue;
+            } else if (len - i >= mcs_len && !strncmp(&s[i], mcs, mcs_len)) {
+                if (hl) memset(&hl[i], HL_MLCOMMENT, mcs_len);
+                i += mcs_len;
+                in_comment = 1;
+                continue;
+            }
+        }
+
+        // 文字列
+        if (syntax->flags & HL_HIGHLIGHT_STRINGS) {
+            if (in_string) {
+                if (hl) hl[i] = HL_STRING;
+                if (c == '\\' && i + 1 < len) {
+                    if (hl) hl[i + 1] = HL_STRING;
+                    i += 2;
+                    continue;
+                }
+                if (c == in_string) in_string = 0;
+                i++;
+                prev_sep = 1;
+                continue;
+            } else if (c == '"' || c == '\'') {
+                in_string = c;
+                if (hl) hl[i] = HL_STRING;
+                i++;
+                continue;
+            }
+        }
+        if (hl == NULL) {
+            i++;
+            continue;
+        }
+
+        // 変数名の数値などを除外しつつハイライトを設定
+        if (syntax->flags & HL_HIGHLIGHT_NUMBERS) {
+            if ((isdigit(c) && (prev_sep || prev_hl == HL_NUMBER)) ||
+                (c == '.' && prev_hl == HL_NUMBER)) {
+                hl[i] = HL_NUMBER;
+                i++;
+                prev_sep = 0;
+                continue;
+            }
+        }
+
+        // キーワードは区切り文字で挟まれている場合だけ
+        if (prev_sep) {
+            int j;
+            for (j = 0; keywords[j]; j++) {
+                int klen = strlen(keywords[j]);
+                int kw2 = keywords[j][klen - 1] == '|';
+                if (kw2) klen--;
+
+                if (len - i >= klen && !strncmp(&s[i], keywords[j], klen) &&
+                    (i + klen == len || benchIsSeparator(s[i + klen]))) {
+                    memset(&hl[i], kw2 ? HL_KEYWORD2 : HL_KEYWORD1, klen);
+                    i += klen;
+                    break;
+                }
+            }
+            if (keywords[j] != NULL) {
+                prev_sep = 0;
+                continue;
+            }
+        }
+
+        prev_sep = benchIsSeparator(c);
+        i++;
+    }
+    return in_comment;
+}
+
+// kilo.cを繰り返して、bytesバイト以上のCのファイルを作る
+char *benchSourceFile(size_t bytes) {
+    char name[64];
+    snprintf(name, sizeof(name), "kilo-bench-src-%zu.c", bytes);
+    char *path = benchPath(name);
+    if (access(path, R_OK) == 0)
+        return path;
+
+    FILE *in = fopen("kilo.c", "r");
+    if (in == NULL) die("kilo.c");
+    char *src = NULL;
+    size_t srclen = 0;
+    FILE *mem = open_memstream(&src, &srclen);
+    char buf[65536];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), in)) > 0)
+        fwrite(buf, 1, n, mem);
+    fclose(mem);
+    fclose(in);
+
+    char *tmp = benchPath("kilo-bench-src.tmp");
+    FILE *fp = fopen(tmp, "w");
+    if (fp == NULL) die("fopen");
+    size_t total;
+    for (total = 0; total < bytes; total += srclen)
+        fwrite(src, 1, srclen, fp);
+    if (fclose(fp) == EOF || rename(tmp, path) == -1) die("write");
+    free(tmp);
+    free(src);
+    return path;
+}
+
+// Cのファイルの全行にハイライトを付ける (前の行の行末の状態を引き継いで順に)
+void benchHighlight() {
+    char *path = benchSourceFile(64000000 * benchScale());
+    double size = benchFileSize(path);
+    editorOpen(path);
+    free(path);
+
+    int maxlen = 1;
+    int j;
+    for (j = 0; j < E.numrows; j++)
+        if (editorRow(j)->size > maxlen)
+            maxlen = editorRow(j)->size;
+    unsigned char *hl = malloc(maxlen);
+    unsigned char *hl2 = malloc(maxlen);
+    if (hl == NULL || hl2 == NULL) die("malloc");
+
+    int in = 0;
+    double t = benchNow();
+    for (j = 0; j < E.numrows; j++) {
+        erow *row = editorRow(j);
+        in = benchSyntaxScanStrchr(row->chars, row->size, in, hl);
+    }
+    t = benchNow() - t;
+    benchReport("user-019", "highlight %.0f MB of C, strchr and strncmp: %7.3f s  %6.1f MB/s",
+        size / 1e6, t, size / t / 1e6);
+
+    in = 0;
+    t = benchNow();
+    for (j = 0; j < E.numrows; j++) {
+        erow *row = editorRow(j);
+        in = editorSyntaxScan(row->chars, row->size, in, hl);
+    }
+    t = benchNow() - t;
+    benchReport("user-019", "highlight %.0f MB of C, editorSyntaxScan:    %7.3f s  %6.1f MB/s",
+        size / 1e6, t, size / t / 1e6);
+
+    // 両方で同じハイライトになるか
+    int differ = 0;
+    int in2 = 0;
+    in = 0;
+    for (j = 0; j < E.numrows; j++) {
+        erow *row = editorRow(j);
+        in = benchSyntaxScanStrchr(row->chars, row->size, in, hl);
+        in2 = editorSyntaxScan(row->chars, row->size, in2, hl2);
+        if (in != in2 || memcmp(hl, hl2, row->size) != 0)
+            differ++;
+    }
+    if (differ)
+        benchReport("user-019", "%d rows highlighted differently", differ);
+    free(hl);
+    free(hl2);
+}
+
+/*** user-021 ***/
+
+// 取り消しの記録が使っているメモリ (記録の配列と文字列のかたまり)
+size_t benchUndoBytes() {
+    size_t n = sizeof(struct undoRecord) * E.undo.cap;
+    struct undoChunk *c;
+    for (c = E.undo.arena; c; c = c->prev)
+        n += sizeof(struct undoChunk) + c->cap;
+    return n;
+}
+
+// 取り消しの記録のメモリを編集1回あたりで測る
+// 続けて打つ場合 (1つの記録にまとまる) と、1文字ごとに別の場所を編集する場合
+void benchUndoMemory() {
+    int n = 1000000 * benchScale();
+    int j;
+    long allocs = bench_allocs;
+    for (j = 0; j < n; j++) {
+        if (j % 80 == 79)
+            editorInsertNewLine();
+        else
+            editorInsertChar('a' + j % 26);
+    }
+    benchReport("user-021", "%d keys typed in 80-column lines:  %6.1f bytes/edit  %.2g allocs/edit",
+        n, (double)benchUndoBytes() / n, (double)(bench_allocs - allocs) / n);
+
+    // 前の行に戻って1文字ずつ打つと、記録はまとまらない
+    size_t before = benchUndoBytes();
+    int rows = E.numrows;
+    allocs = bench_allocs;
+    for (j = 0; j < n; j++) {
+        E.cy = j % rows;
+        E.cx = 0;
+        editorInsertChar('x');
+    }
+    benchReport("user-021", "%d keys each at a different row: %6.1f bytes/edit  %.2g allocs/edit",
+        n, (double)(benchUndoBytes() - before) / n, (double)(bench_allocs - allocs) / n);
+}
+
+// 1行に打った20万文字をBackspaceで全部消す (消した分は1つの記録にまとまる)
+void benchUndoBackspace() {
+    int n = 200000 * benchScale();
+    int j;
+    for (j = 0; j < n; j++)
+        editorInsertChar('a' + j % 26);
+    double t = benchNow();
+    for (j = 0; j < n; j++)
+        editorDelChar();
+    t = benchNow() - t;
+    benchReport("user-021", "%d backspaces in one line:  %7.3f s", n, t);
+
+    t = benchNow();
+    editorUndo();
+    t = benchNow() - t;
+    benchReport("user-021", "undo the backspaces:          %7.3f s  (%d chars back)", t, editorRow(0)->size);
+}
+
+// 100MBの貼り付けを取り消してやり直す
+void benchUndoPaste() {
+    size_t len = 100000000 * benchScale();
+    char *text = malloc(len);
+    if (text == NULL) die("malloc");
+    size_t j;
+    for (j = 0; j < len; j++)
+        text[j] = j % 80 == 79 ? '\n' : 'a' + j % 26;
+
+    double t = benchNow();
+    editorInsertText(text, len);
+    editorUndoInsert(0, 0, 1, text, len);
+    t = benchNow() - t;
+    benchReport("user-021", "paste %.0f MB (%d rows):  %7.3f s  undo memory %.1f MB",
+        len / 1e6, E.numrows, t, benchUndoBytes() / 1e6);
+
+    t = benchNow();
+    editorUndo();
+    t = benchNow() - t;
+    benchReport("user-021", "undo the paste:              %7.3f s  (%d rows left)", t, E.numrows);
+
+    t = benchNow();
+    editorRedo();
+    t = benchNow() - t;
+    benchReport("user-021", "redo the paste:              %7.3f s  (%d rows)", t, E.numrows);
+    free(text);
+}
+
+/*** user-022 ***/
+
+int benchCompareDouble(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+// ファイルを開いて100万回打ち、1回ごとの時間を測る。journalならジャーナルに記録しながら
+void benchTyping(int journal) {
+    int n = 1000000 * benchScale();
+    char *path = benchPath("kilo-bench-journal.txt");
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) die("open");
+    close(fd);
+    char *jpath = editorJournalPath(path);
+    unlink(jpath);
+    E.filename = path;
+    if (journal)
+        editorJournalOpen();
+
+    double *lat = malloc(sizeof(double) * n);
+    if (lat == NULL) die("malloc");
+    int j;
+    double total = benchNow();
+    for (j = 0; j < n; j++) {
+        double t = benchNow();
+        if (j % 80 == 79)
+            editorInsertNewLine();
+        else
+            editorInsertChar('a' + j % 26);
+        lat[j] = benchNow() - t;
+    }
+    total = benchNow() - total;
+    qsort(lat, n, sizeof(double), benchCompareDouble);
+    benchReport("user-022", "%d keys, journal %-3s: %6.0f ns/key  p50 %5.0f ns  p99 %5.0f ns  max %7.0f ns",
+        n, journal ? "on" : "off", total / n * 1e9, lat[n / 2] * 1e9, lat[n / 100 * 99] * 1e9,
+        lat[n - 1] * 1e9);
+    free(lat);
+
+    if (E.journal) {
+        // 書き込みスレッドが書き終わるのを待ってから大きさを見る
+        struct editorJournal *jr = E.journal;
+        pthread_mutex_lock(&jr->mutex);
+        while (jr->len > 0 || jr->busy) {
+            pthread_mutex_unlock(&jr->mutex);
+            usleep(1000);
+            pthread_mutex_lock(&jr->mutex);
+        }
+        pthread_mutex_unlock(&jr->mutex);
+        benchReport("user-022", "journal: %.1f MB written with %ld fdatasync calls",
+            benchFileSize(jpath) / 1e6, bench_syncs);
+        editorJournalRemove();
+    }
+    unlink(path);
+    free(jpath);
+}
+
+void benchTypingNoJournal() {
+    benchTyping(0);
+}
+
+void benchTypingJournal() {
+    benchTyping(1);
+}
+
+/*** user-023 ***/
+
+// 1000万行のファイルを、行ごとにcharsをコピーする経路 (mmapできない時と同じ) で開いて、
+// 1行あたりのメモリと確保の回数、開く時間を測る
+// make benchはSLAB_MAXを0にしてコンパイルしたkilo-bench-mallocでも実行して、
+// サイズクラスのスラブを使わずに1行ずつmallocする場合と比べる
+void benchOpenRows() {
+    int rows = 10000000 * benchScale();
+    char *path = benchLogFile(rows);
+    double size = benchFileSize(path);
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL) die("fopen");
+    free(path);
+
+    char *line = NULL;
+    size_t linecap = 0;
+    ssize_t linelen;
+    double rss = benchRss();
+    long allocs = bench_allocs;
+    double t = benchNow();
+    while ((linelen = getline(&line, &linecap, fp)) != -1) {
+        if (linelen > 0 && line[linelen - 1] == '\n')
+            linelen--;
+        editorInsertRow(E.numrows, line, linelen);
+    }
+    t = benchNow() - t;
+    free(line);
+    fclose(fp);
+    benchReport("user-023", "open %.0f MB (%d rows), %-6s: %7.3f s  %6.1f bytes/row  %.3g allocs/row",
+        size / 1e6, E.numrows, SLAB_MAX ? "slab" : "malloc", t, (benchRss() - rss) / E.numrows,
+        (double)(bench_allocs - allocs) / E.numrows);
+
+    // 行を全部消して同じだけ作り直す (解放したものを使い回せるか)
+    t = benchNow();
+    while (E.numrows > 0)
+        editorDelRow(E.numrows - 1);
+    int j;
+    for (j = 0; j < rows; j++)
+        editorInsertRow(E.numrows, "2026-10-17 12:00:00 INFO worker-1 request 1 took 1 ms", 53);
+    t = benchNow() - t;
+    benchReport("user-023", "free and insert %d rows again, %-6s: %7.3f s  %6.1f bytes/row now",
+        rows, SLAB_MAX ? "slab" : "malloc", t, (benchRss() - rss) / E.numrows);
+}
+
+/*** user-024 ***/
+
+// タブの無い行もrenderを別に確保していた時のeditorBuildRender (renderとhlを1つの領域に並べる)
+void benchBuildRenderSeparate(erow *row) {
+    erender *r = row->r;
+    int tabs = 0;
+    int j;
+    for (j = 0; j < row->size; j++)
+        if (row->chars[j] == '\t') tabs++;
+
+    int need = row->size + tabs*(KILO_TAB_STOP - 1) + 1;
+    r->rcap = editorSlabSize(2 * need) / 2;
+    r->render = editorSlabAlloc(2 * r->rcap);
+    r->hl = (unsigned char *)r->render + r->rcap;
+
+    int idx = 0;
+    for (j = 0; j < row->size; j++) {
+        if (row->chars[j] == '\t') {
+            r->render[idx++] = ' ';
+            while (idx % KILO_TAB_STOP != 0) r->render[idx++] = ' ';
+        } else {
+            r->render[idx++] = row->chars[j];
+        }
+    }
+    r->render[idx] = '\0';
+    r->rsize = idx;
+    editorUpdateSyntax(row);
+}
+
+// タブの無い100万行のログの全行にrenderとhlを作り、増えたメモリを測る
+// (エディタはKILO_RENDER_CACHE行分しか持たないが、ここではLRUを通さずに全行分作る)
+void benchRender(int separate) {
+    int rows = 1000000 * benchScale();
+    char *path = benchLogFile(rows);
+    editorOpen(path);
+    free(path);
+    // mmapしたファイルのページも常駐メモリに数えられるので、先に全部読んでおく
+    long long sum = 0;
+    int j;
+    for (j = 0; j < E.numrows; j++) {
+        erow *row = editorRow(j);
+        sum += row->size ? row->chars[row->size - 1] : 0;
+    }
+
+    double rss = benchRss();
+    long long bytes = 0;
+    double t = benchNow();
+    for (j = 0; j < E.numrows; j++) {
+        erow *row = editorRow(j);
+        erender *r = editorAllocRender();
+        memset(r, 0, sizeof(*r));
+        r->row = row;
+        row->r = r;
+        if (separate) {
+            benchBuildRenderSeparate(row);
+            bytes += 2 * r->rcap;
+        } else {
+            editorBuildRender(row);
+            bytes += (row->flags & ROW_RENDER_CHARS) ? r->rcap : 2 * r->rcap;
+        }
+    }
+    t = benchNow() - t;
+    benchReport("user-024", "render %d rows without tabs, %-14s %7.3f s  %6.1f buffer bytes/row  %6.1f rss bytes/row",
+        E.numrows, separate ? "separate:" : "shared chars:", t, (double)bytes / E.numrows,
+        (benchRss() - rss) / E.numrows);
+}
+
+void benchRenderShared() {
+    benchRender(0);
+}
+
+void benchRenderSeparate() {
+    benchRender(1);
+}
+
+/*** user-025 ***/
+
+// 1000万行のファイルで全行をたどる処理と、真ん中への行の挿入を測る
+void benchRowScans() {
+    int rows = 10000000 * benchScale();
+    char *path = benchLogFile(rows);
+    double size = benchFileSize(path);
+    editorOpen(path);
+    free(path);
+    // 最初に全部のページを読んでおく (後の計測にページフォールトが入らないように)
+    long long total = 0;
+    int j;
+    for (j = 0; j < E.numrows; j++) {
+        erow *row = editorRow(j);
+        total += row->size ? row->chars[row->size - 1] : 0;
+    }
+
+    // 保存のスナップショットで行の大きさを足し合わせるのと同じ
+    double t = benchNow();
+    total = 0;
+    for (j = 0; j < E.numrows; j++)
+        total += editorRow(j)->size + 1;
+    t = benchNow() - t;
+    benchReport("user-025", "%d rows, size pass:             %7.3f s  %5.2f ns/row  (%lld bytes)",
+        E.numrows, t, t / E.numrows * 1e9, total);
+
+    // 文字列の検索 (めったに無いものと10行に1つのもの)
+    const char *queries[] = { "took 999 ms", "timeout" };
+    unsigned int q;
+    for (q = 0; q < sizeof(queries) / sizeof(queries[0]); q++) {
+        t = benchNow();
+        editorFindBuild(queries[q]);
+        t = benchNow() - t;
+        benchReport("user-025", "%d rows, find %-17s %7.3f s  %5.2f ns/row  (%d matches)",
+            E.numrows, queries[q], t, t / E.numrows * 1e9, E.find.n);
+        editorFindClear();
+    }
+
+    // 真ん中に行を挿入する (行のギャップバッファのギャップをそこに動かす)
+    int n = 10000;
+    E.cy = E.numrows / 2;
+    E.cx = 0;
+    t = benchNow();
+    for (j = 0; j < n; j++)
+        editorInsertNewLine();
+    t = benchNow() - t;
+    benchReport("user-025", "%d rows, insert %d rows in the middle: %7.3f s  %5.0f ns/row",
+        E.numrows, n, t, t / n * 1e9);
+
+    // 保存 (編集した行以外はmmapしたファイルの中を指したまま書く)
+    E.filename = benchPath("kilo-bench-save.txt");
+    t = benchNow();
+    editorSave();
+    editorSaveWait();
+    t = benchNow() - t;
+    benchReport("user-025", "%d rows, save %.0f MB:         %7.3f s  %5.2f GB/s",
+        E.numrows, size / 1e6, t, size / t / 1e9);
+    unlink(E.filename);
+}
+
+// 最初のkiloのerow。行はこの構造体の配列で、挿入・削除のたびに後ろをmemmoveしていた
+struct benchAosRow {
+    int size;
+    int rsize;
+    char *chars;
+    char *render;
+    unsigned char *hl;
+};
+
+// 行ごとの状態を要素ごとの配列に分けた形 (structure of arrays)
+struct benchSoaRows {
+    int *size;
+    unsigned char *hl_oc;
+    char **chars;
+};
+
+// 全行をたどる3つの処理を、行の持ち方 (layout) ごとに同じ形のループで測る
+// size: 保存の時と同じく行の大きさを足し合わせる
+// count: 空でなく、行末で複数行コメントが開いていない行を数える (コードの行数のように行の状態を2つ読む)
+// find: 各行のcharsから文字列を探す (charsの中身も読む)
+#define BENCH_SCANS(label, SIZE, OC, CHARS) do { \
+    double t = benchNow(); \
+    long long total = 0; \
+    for (j = 0; j < n; j++) \
+        total += SIZE + 1; \
+    t = benchNow() - t; \
+    benchReport("user-025", "%d rows, %-22s size  %6.2f ns/row  (%lld bytes)", n, label, t / n * 1e9, total); \
+    t = benchNow(); \
+    long lines = 0; \
+    for (j = 0; j < n; j++) \
+        lines += SIZE > 0 && OC == 0; \
+    t = benchNow() - t; \
+    benchReport("user-025", "%d rows, %-22s count %6.2f ns/row  (%ld lines)", n, label, t / n * 1e9, lines); \
+    t = benchNow(); \
+    long found = 0; \
+    for (j = 0; j < n; j++) \
+        found += editorFindInRow(CHARS, SIZE, "timeout", 7) != NULL; \
+    t = benchNow() - t; \
+    benchReport("user-025", "%d rows, %-22s find  %6.2f ns/row  (%ld rows)", n, label, t / n * 1e9, found); \
+} while (0)
+
+// 今の持ち方 (erowへのポインタのギャップバッファ) の全行をたどる処理を、
+// 最初のkiloの構造体の配列と、要素ごとの配列に分けた形と比べる
+void benchRowLayouts() {
+    int rows = 10000000 * benchScale();
+    char *path = benchLogFile(rows);
+    editorOpen(path);
+    free(path);
+    int n = E.numrows;
+    int j;
+
+    struct benchAosRow *aos = malloc(sizeof(*aos) * n);
+    struct benchSoaRows soa;
+    soa.size = malloc(sizeof(int) * n);
+    soa.hl_oc = malloc(n);
+    soa.chars = malloc(sizeof(char *) * n);
+    if (aos == NULL || soa.size == NULL || soa.hl_oc == NULL || soa.chars == NULL) die("malloc");
+    long long touch = 0;
+    for (j = 0; j < n; j++) {
+        erow *row = editorRow(j);
+        aos[j].size = aos[j].rsize = row->size;
+        aos[j].chars = row->chars;
+        aos[j].render = NULL;
+        aos[j].hl = NULL;
+        soa.size[j] = row->size;
+        soa.hl_oc[j] = row->hl_oc;
+        soa.chars[j] = row->chars;
+        // mmapしたファイルのページを先に読んでおく
+        touch += row->size ? row->chars[row->size - 1] : 0;
+    }
+
+    BENCH_SCANS("array of erow:", aos[j].size, 0, aos[j].chars);
+    BENCH_SCANS("separate arrays:", soa.size[j], soa.hl_oc[j], soa.chars[j]);
+    BENCH_SCANS("editorRow():", editorRow(j)->size, editorRow(j)->hl_oc, editorRow(j)->chars);
+
+    // 編集を繰り返すとerowはフリーリストから使い回され、メモリ上の並びが行の順でなくなる
+    // 最悪の場合として、erowをばらばらの順に並べ直した場合
+    erow **shuffled = malloc(sizeof(erow *) * n);
+    int *order = malloc(sizeof(int) * n);
+    if (shuffled == NULL || order == NULL) die("malloc");
+    for (j = 0; j < n; j++)
+        order[j] = j;
+    unsigned int seed = 1;
+    for (j = n - 1; j > 0; j--) {
+        seed = seed * 1103515245 + 12345;
+        int k = ((size_t)seed << 16 ^ (seed >> 16)) % (j + 1);
+        int tmp = order[j];
+        order[j] = order[k];
+        order[k] = tmp;
+    }
+    // order[j]番目のerowの置き場所に行jの中身を置く
+    erow *slots = malloc(sizeof(erow) * n);
+    if (slots == NULL) die("malloc");
+    for (j = 0; j < n; j++) {
+        slots[order[j]] = *editorRow(j);
+        shuffled[j] = &slots[order[j]];
+    }
+    BENCH_SCANS("editorRow(), scattered:", shuffled[j]->size, shuffled[j]->hl_oc, shuffled[j]->chars);
+
+    // 真ん中に行を挿入する。最初のkiloは後ろの行の構造体をすべてmemmoveする
+    // ギャップバッファは最初の1行でギャップを真ん中に動かし、残りはO(1)
+    int ins = 100;
+    struct benchAosRow *grown = realloc(aos, sizeof(*aos) * (n + ins));
+    if (grown == NULL) die("realloc");
+    aos = grown;
+    double t = benchNow();
+    for (j = 0; j < ins; j++) {
+        memmove(&aos[n / 2 + 1], &aos[n / 2], sizeof(*aos) * (n + j - n / 2));
+        aos[n / 2].size = 0;
+    }
+    t = benchNow() - t;
+    benchReport("user-025", "%d rows, array of erow: insert in the middle %8.0f ns/row", n, t / ins * 1e9);
+    E.cy = n / 2;
+    E.cx = 0;
+    t = benchNow();
+    for (j = 0; j < ins; j++)
+        editorInsertNewLine();
+    t = benchNow() - t;
+    benchReport("user-025", "%d rows, editorRow():   insert in the middle %8.0f ns/row", n, t / ins * 1e9);
+    if (touch == 0)
+        benchReport("user-025", "empty file");
+
+    free(slots);
+    free(order);
+    free(shuffled);
+    free(aos);
+    free(soa.size);
+    free(soa.hl_oc);
+    free(soa.chars);
+}
+
+/*** main ***/
+
+struct benchEntry {
+    const char *name;
+    void (*run)();
+};
+
+struct benchEntry benches[] = {
+    { "user-004", benchTypeLine },
+    { "user-010", benchReadKeys },
+    { "user-013", benchOpenGetline },
+    { "user-013", benchOpen },
+    { "user-014", benchIncrementalSearch },
+    { "user-016", benchRegex },
+    { "user-016", benchRegexPathological },
+    { "user-017", benchReplace },
+    { "user-019", benchHighlight },
+    { "user-021", benchUndoMemory },
+    { "user-021", benchUndoBackspace },
+    { "user-021", benchUndoPaste },
+    { "user-022", benchTypingNoJournal },
+    { "user-022", benchTypingJournal },
+    { "user-023", benchOpenRows },
+    { "user-024", benchRenderSeparate },
+    { "user-024", benchRenderShared },
+    { "user-025", benchRowScans },
+    { "user-025", benchRowLayouts },
+};
+
+#define BENCH_ENTRIES (sizeof(benches) / sizeof(benches[0]))
+
+// 子プロセスで新しいエディタの状態から実行する
+void benchRun(struct benchEntry *b) {
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == -1) die("fork");
+    if (pid == 0) {
+        initEditor();
+        b->run();
+        exit(0);
+    }
+    int status;
+    if (waitpid(pid, &status, 0) == -1) die("waitpid");
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        benchReport(b->name, "failed");
+}
+
+int main(int argc, char *argv[]) {
+    unsigned int i;
+    for (i = 0; i < BENCH_ENTRIES; i++) {
+        int selected = argc < 2;
+        int j;
+        for (j = 1; j < argc; j++)
+            if (strcmp(argv[j], benches[i].name) == 0)
+                selected = 1;
+        if (selected)
+            benchRun(&benches[i]);
+    }
+    return 0;
+}
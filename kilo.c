@@ -7,23 +7,41 @@
 #include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <termios.h>
 #include <time.h>
 #include <unistd.h>
 
 #include <signal.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 /*** defines ***/
 
 #define KILO_VERSION "0.0.1"
 #define KILO_TAB_STOP 8
 #define KILO_QUIT_TIMES 1
+#define KILO_RENDER_CACHE 1024 // renderとhlを保持しておく行数の上限
+#define KILO_MAX_FPS 60 // 1秒あたりの描画回数の上限 (実行時は環境変数KILO_FPSで変えられる)
+#define KILO_SAVE_IOV 1024 // 保存時に1回のwritevで書く要素数
+#define KILO_SAVE_FSYNC 1 // 保存時のfsync 0: しない 1: ファイル 2: ファイルとディレクトリ
+#define KILO_OPEN_CHUNK (8 << 20) // 開く時に1スレッドが改行を探す大きさの下限
+#define KILO_THREADS 16 // 処理を分けて並列に行う時のスレッド数の上限
+#define KILO_FIND_CHUNK 65536 // 全件検索で1スレッドが受け持つ行数の下限
+#define KILO_RE_STATES 1024 // 正規表現のDFAでキャッシュする状態数の上限
+#define KILO_UNDO_CHUNK 65536 // 取り消しの記録の文字列を置くかたまりの大きさ
 
 // Ctrl+X を制御文字に変換する 6, 7bitを落とすと変換できる
 #define CTRL_KEY(k) ((k) & 0x1f)
@@ -39,13 +57,38 @@ enum editorKey {
     HOME_KEY,
     END_KEY,
     PAGE_UP,
-    PAGE_DOWN
+    PAGE_DOWN,
+    PASTE // 貼り付け (bracketed paste)。中身はE.pasteに入っている
+};
+
+// erow.flags
+enum editorRowFlag {
+    ROW_MAPPED = 1 << 0,   // charsがmmapしたファイルの中を直接指している (書き換え・解放不可)
+    ROW_HL_STALE = 1 << 1, // charsが変わったのでhl_ocを計算し直す必要がある
+    ROW_RENDER_CHARS = 1 << 2 // タブが無いのでrenderはcharsを指している (hlだけを確保している)
 };
 
 enum editorHighlight {
     HL_NORMAL = 0,
+    HL_COMMENT,
+    HL_MLCOMMENT,
+    HL_KEYWORD1,
+    HL_KEYWORD2,
+    HL_STRING,
     HL_NUMBER,
-    HL_MATCH
+    HL_MATCH,
+    HL_STATUSBAR // ステータスバー (反転表示)
+};
+
+#define HL_HIGHLIGHT_NUMBERS (1<<0)
+#define HL_HIGHLIGHT_STRINGS (1<<1)
+
+// editorSyntax.classesの値 (文字ごとの種類)
+enum editorCharClass {
+    CC_SEPARATOR = 1 << 0, // キーワードや数値の区切り
+    CC_DIGIT = 1 << 1,
+    CC_QUOTE = 1 << 2,     // 文字列の開始
+    CC_COMMENT = 1 << 3    // 1行・複数行コメントの開始の1文字目
 };
 
 /*** my ***/
@@ -67,19 +110,199 @@ void debug() {
 
 /*** data ***/
 
-typedef struct erow {
-    int size;    // 行の文字数 NULL文字も改行文字も入らない charsのサイズ
+struct editorKeyword {
+    const char *word; // 末尾の | は含まない (lenまで)
+    int len;          // 0なら空き
+    unsigned char hl; // HL_KEYWORD1 or HL_KEYWORD2
+};
+
+struct editorSyntax {
+    char *filetype;
+    char **filematch;  // ファイル名に含まれていたらこのsyntaxを使う (.で始まるものは拡張子)
+    char **keywords;   // 末尾が | のものはKEYWORD2 (型など)
+    char *singleline_comment_start;
+    char *multiline_comment_start;
+    char *multiline_comment_end;
+    int flags;
+    const unsigned char *classes; // 文字 -> enum editorCharClass の256要素の表
+
+    // keywordsの完全ハッシュ表 (最初に使う時にeditorSyntaxKeywordsで作る)
+    struct editorKeyword *kwtab;
+    unsigned int kwmask;
+    unsigned int kwseed;
+    int kwmin, kwmax; // キーワードの長さの範囲
+};
+
+// 行の描画用の状態 (renderとhl)
+// 描画や検索で必要になった行だけが持ち、LRUで上限を超えた分は捨てる
+// なので何行のファイルでもKILO_RENDER_CACHE個程度しか無い
+typedef struct erender {
     int rsize;   // タブなど特殊文字を含めた文字数 renderとhlのサイズ
-    char *chars; // 行の文字列 NULL文字は入るが改行文字は入らない
-    char *render;
+    int rcap;    // renderとhlのそれぞれに確保しているバイト数
+    char *render; // renderとhlは1つの領域 (2 * rcapバイト) の前半と後半
+                  // ROW_RENDER_CHARSの時はrender = charsで、hlだけをrcapバイト確保する
+                  // (ROW_MAPPEDの行ではNULL文字で終わっていないので、rsizeで長さを見ること)
 
     // hl is an array of unsigned char values, meaning integers in the range of
     // 0 to 255. Each value in the array will correspond to a character in
     // render, and will tell you whether that character is part of a string, or
     // a comment, or a number, and so on.
     unsigned char *hl; // highlight
+    struct erow *row;  // 持ち主の行
+
+    // 作られている行を最近使った順に繋ぐ双方向リスト (NULLで終端)
+    struct erender *lru_prev;
+    struct erender *lru_next;
+} erender;
+
+// 行ごとの状態は、保存・検索・ハイライトの計算のように全行をたどる処理が使うものだけにして、
+// 描画用の状態はerenderに分ける。erowを32バイトに収めて、1キャッシュラインに2行入るようにする
+typedef struct erow {
+    int size;    // 行の文字数 NULL文字も改行文字も入らない charsのサイズ
+    int cap;     // charsに確保しているバイト数 (ROW_MAPPEDの時は0)
+    int savegen; // charsを用意した時のE.savegen (保存中のスナップショットに含まれるかの判定用)
+    unsigned char flags; // enum editorRowFlag
+    unsigned char hl_in; // hl_ocとhlを計算した時の行頭の状態 (前の行のhl_oc)
+    unsigned char hl_oc; // 行末で複数行コメントが閉じていないか (open comment)
+    char *chars; // 行の文字列 NULL文字は入るが改行文字は入らない
+    erender *r;  // renderとhl (作られていなければNULL)
 } erow;
 
+// 画面1枚分のセル。(screenrows + 2) * screencols の文字と色 (enum editorHighlight)
+struct editorFrame {
+    char *chars;
+    unsigned char *hl;
+};
+
+// 全件検索で見つかった位置
+struct editorMatch {
+    int row;
+    int col; // chars上の位置
+    int len; // マッチした長さ (chars上)
+};
+
+struct editorMatchList {
+    struct editorMatch *m;
+    int n;
+    int cap;
+};
+
+// 取り消し (undo) の記録の種類
+enum undoType {
+    UNDO_INSERT, // (row, col)にtextを挿入した。挿入した範囲の終わりは(endrow, endcol)
+    UNDO_DELETE  // (row, col)から(endrow, endcol)までのtextを削除した
+};
+
+enum undoFlag {
+    UNDO_NEWROW = 1 << 0, // 最後の行の次 (まだ行が無い所) に行を作ってから挿入した
+    UNDO_CHAIN = 1 << 1,  // 1つ前の記録と一緒に取り消す (置換などの複数行の操作)
+    UNDO_TYPING = 1 << 2, // 1文字ずつの入力・削除 (続けて打った分を1つにまとめてよい)
+    UNDO_REVERSED = 1 << 3 // textを逆順に持っている (続けてBackspaceした分を末尾に足していくため)
+};
+
+// 記録の文字列を詰めて置くかたまり (1回の編集ごとにmallocしない)
+// 古いかたまりへprevで繋ぐ。やり直しの記録を捨てる時は末尾から巻き戻す
+struct undoChunk {
+    struct undoChunk *prev;
+    size_t used;
+    size_t cap;
+    char data[];
+};
+
+struct undoRecord {
+    unsigned char type;     // enum undoType
+    unsigned char flags;    // enum undoFlag
+    int row, col;
+    int endrow, endcol;
+    int bx, by;             // 操作前のカーソル位置 (取り消した後に戻す)
+    int ax, ay;             // 操作後のカーソル位置 (やり直した後に戻す)
+    char *text;             // 挿入・削除した文字列 (chunkの中を指す)
+    size_t len;
+    struct undoChunk *chunk;
+};
+
+struct editorUndo {
+    struct undoRecord *rec; // 古い順
+    int n;
+    int cap;
+    int cur;                // rec[0, cur)が適用済みで、rec[cur, n)はやり直せる
+    struct undoChunk *arena; // 最後に使ったかたまり
+};
+
+// 保存スレッドからメインスレッドへの通知
+struct saveEvent {
+    int done;        // 1なら保存が終わった
+    int err;         // 失敗した時のerrno (成功なら0)
+    long long bytes; // 書き込んだバイト数
+};
+
+// バックグラウンドで実行中の保存
+// 保存スレッドはEに触らず、保存を始めた時に作った行のスナップショット (rows) だけを読む
+struct saveJob {
+    pthread_t thread;
+    int pipefd[2];      // 保存スレッドからの通知 (struct saveEvent) を送るパイプ
+    char *filename;
+    char *path;         // 書き込むファイル (シンボリックリンクはたどったもの)
+    char *tmp;          // 書き込む一時ファイル。NULLならpathに直接書く
+    int fd;             // pathかtmpを開いたもの
+    const char *note;   // 保存が終わった時のメッセージに添える注意 (無ければNULL)
+    mode_t mask;        // 新しいファイルを作る時のumask
+    struct iovec *rows; // 各行のcharsとsize。保存が終わるまでcharsは書き換えも解放もしない
+    int numrows;
+    long long total;    // 書き込むバイト数
+    int dirty;          // 保存を始めた時のE.dirty
+    int gen;            // savegenがこれより小さい行はスナップショットに含まれている
+    struct iovec *garbage; // 保存が終わるまで解放を遅らせるcharsと確保した大きさ
+    int ngarbage;
+    int garbagecap;
+};
+
+// ジャーナル (.ファイル名.kilo-journal) の先頭。編集を適用する元のファイルを識別する
+struct journalHeader {
+    char magic[8];
+    long long dev;
+    long long ino;
+    long long size; // ファイルが無ければ-1
+    long long mtime_sec;
+    long long mtime_nsec;
+};
+
+// ジャーナルの編集1回分。直後にlenバイトの文字列が続く
+struct journalRecord {
+    unsigned char type;  // enum undoType
+    unsigned char flags; // UNDO_NEWROWだけ
+    unsigned short pad;
+    int row, col;
+    int endrow, endcol;
+    unsigned int len;
+    unsigned int sum;    // sumを0にしたこの構造体と文字列のハッシュ (書きかけの記録を見分ける)
+};
+
+// 書き込み中のジャーナル
+// メインスレッドは記録をbufに追記するだけで、書き込みスレッドが溜まった分をまとめて
+// 1回のwriteとfdatasyncで書く (group commit)。fdとpathは書き込みスレッドだけが変える
+struct editorJournal {
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;  // 書き込みスレッドを起こす
+    pthread_cond_t idle;  // 書き込みスレッドが1回分を書き終えた
+    int busy;             // 書き込みスレッドが書いている
+    char *path;     // ファイル名が無い間はNULL (記録は書かずに捨てる)
+    int fd;
+    char *buf;      // まだ書いていない記録
+    size_t len;
+    size_t cap;
+    // 保存を始めてからの記録。保存が終わったら、これだけを残したジャーナルに作り直す
+    int marked;
+    char *tail;
+    size_t taillen;
+    size_t tailcap;
+    // 保存が終わった後の作り直しの依頼
+    int reset;
+    char *resetpath;
+    struct journalHeader resethdr;
+};
+
 struct editorConfig {
     int cx, cy;     // テキストファイルに対してのカーソル位置, cx: 列, cy: 行
     int rx;         // 画面描画上のファイルに対してのカーソル位置, conputed valueでcxから算出されるので更新不要
@@ -88,25 +311,131 @@ struct editorConfig {
     int screenrows;
     int screencols;
     int numrows;    // ファイルの行数 (*row の要素数)
-    // 構造体の配列で1要素がファイル行に該当する
-    // 配列であるかどうかは型定義だけ見ても判別できない
-    // 判別するためには mallocなどの確保の仕方を見るかアクセスの仕方を見る
-    // 構造体へのポインタ      malloc(sizeof(struct 構造体))   , struct->member
-    // 構造体配列へのポインタ  malloc(sizeof(struct 構造体) * 要素数), struct[0].member
-    erow *row;
+    // 行はerowへのポインタのギャップバッファで持つ
+    // row[0, gap) と row[gap + (rowcap - numrows), rowcap) が行で、間が空き (ギャップ)
+    // 挿入・削除はギャップを編集位置に動かしてから行うので、同じ辺りを編集している間はO(1)
+    // erow自体は動かないのでポインタを保持しておける。行へのアクセスはeditorRow()を使う
+    erow **row;
+    int rowcap;     // rowの要素数 (行数 + ギャップ)
+    int gap;        // ギャップの開始位置
+    erender *lru_head; // renderを持っている行のうち最近使った行
+    erender *lru_tail; // renderを持っている行のうち一番使われていない行
+    int nrendered;  // renderを持っている行数
+    char *map;      // mmapしたファイルの先頭 (mmapで開いていない場合はNULL)
+    size_t maplen;
+    size_t mappage; // ページの大きさ (シグナルハンドラの中でsysconfを呼ばないよう取っておく)
+    size_t mapcut;  // ファイルが切り詰められて0のページに差し替えた所 (mapからの位置)
+    volatile sig_atomic_t maptruncated; // SIGBUSで差し替えたがまだ行をコピーしていない
     int dirty; // ファイルが編集されたかどうか
+    struct saveJob *save; // 実行中の保存 (保存中でなければNULL)
+    int savegen;          // 保存を始めるたびに増やす
+    int prompting;        // editorPromptで入力中
+    // 全件検索の索引 (行, 列の順)。検索していない時はfind_queryがNULL
+    // 編集された行の分だけ更新するので、検索し直さなくても最新の状態を保つ
+    char *find_query;
+    int find_qlen;
+    int find_regex;                   // 1なら検索語を正規表現として扱う
+    struct editorRegex *find_re;      // コンパイルした検索語 (正規表現が正しくなければNULL)
+    struct editorReMatcher *find_rm;  // 編集された行を探し直す時に使う照合器
+    struct editorMatchList find;
+    struct editorUndo undo;
+    struct editorJournal *journal; // 書き込みスレッドを起動できなければNULL
+    struct editorSyntax *syntax; // 今のファイルのハイライト (無ければNULL)
+    // 行[0, hl_frontier)はhl_ocが正しい。それより後ろは必要になった時に計算する
+    // 編集された行より後ろは、hl_ocが変わった所までしか計算し直さない
+    int hl_frontier;
+    // hl_frontierを画面外まで進めておくバックグラウンドスレッド (editorSyntaxThread) との排他
+    // Eの行とハイライトの状態はhl_mutexを持っているスレッドだけが触る
+    // メインスレッドは普段はずっと持っていて、入力を待つ間だけ離す
+    pthread_mutex_t hl_mutex;
+    pthread_cond_t hl_cond;
+    int hl_idle;  // メインスレッドが入力待ちでhl_mutexを離している
+    int hl_pause; // メインスレッドがhl_mutexを取り戻そうとしている (__atomicで読み書き)
     char *filename;
     char statusmsg[80];
     time_t statusmsg_time;
     struct termios orig_termios;
+
+    char *paste;     // 最後に貼り付けられた文字列 (PASTEキーの中身)
+    size_t pastelen;
+    size_t pastecap;
+
+    // 差分描画用。frameに今回の画面を作り、前回端末に出力したprevと違う所だけ送る
+    struct editorFrame frame;
+    struct editorFrame prev;
+    int prev_valid;  // 0ならprevは当てにならないので全部描き直す
+    int prev_rowoff; // prevを描いた時のrowoff (スクロール量の検出用)
+    int prev_coloff;
 };
 
 struct editorConfig E;
 
+/*** filetypes ***/
+
+char *C_HL_extensions[] = { ".c", ".h", ".cpp", NULL };
+char *C_HL_keywords[] = {
+    "switch", "if", "while", "for", "break", "continue", "return", "else",
+    "struct", "union", "typedef", "static", "enum", "class", "case",
+
+    "int|", "long|", "double|", "float|", "char|", "unsigned|", "signed|",
+    "void|", NULL
+};
+
+// 文字の種類の表はコンパイル時に静的な初期化子で作る
+// 空白とNULL文字、数字は全言語で共通。記号は言語ごとに書く
+// (同じ文字を2回書くと-Woverride-initになるので、コメントの開始文字はCC_SEPARATORと一緒に書く)
+#define HL_CLASS_SPACES \
+    ['\0'] = CC_SEPARATOR, [' '] = CC_SEPARATOR, ['\t'] = CC_SEPARATOR, \
+    ['\n'] = CC_SEPARATOR, ['\v'] = CC_SEPARATOR, ['\f'] = CC_SEPARATOR, \
+    ['\r'] = CC_SEPARATOR
+#define HL_CLASS_DIGITS \
+    ['0'] = CC_DIGIT, ['1'] = CC_DIGIT, ['2'] = CC_DIGIT, ['3'] = CC_DIGIT, \
+    ['4'] = CC_DIGIT, ['5'] = CC_DIGIT, ['6'] = CC_DIGIT, ['7'] = CC_DIGIT, \
+    ['8'] = CC_DIGIT, ['9'] = CC_DIGIT
+
+const unsigned char C_HL_classes[256] = {
+    HL_CLASS_SPACES,
+    HL_CLASS_DIGITS,
+    [','] = CC_SEPARATOR, ['.'] = CC_SEPARATOR, ['('] = CC_SEPARATOR,
+    [')'] = CC_SEPARATOR, ['+'] = CC_SEPARATOR, ['-'] = CC_SEPARATOR,
+    ['/'] = CC_SEPARATOR | CC_COMMENT, ['*'] = CC_SEPARATOR,
+    ['='] = CC_SEPARATOR, ['~'] = CC_SEPARATOR, ['%'] = CC_SEPARATOR,
+    ['<'] = CC_SEPARATOR, ['>'] = CC_SEPARATOR, ['['] = CC_SEPARATOR,
+    [']'] = CC_SEPARATOR, [';'] = CC_SEPARATOR,
+    ['"'] = CC_QUOTE, ['\''] = CC_QUOTE,
+};
+
+// highlight database
+struct editorSyntax HLDB[] = {
+    {
+        "c",
+        C_HL_extensions,
+        C_HL_keywords,
+        "//", "/*", "*/",
+        HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS,
+        C_HL_classes,
+        NULL, 0, 0, 0, 0
+    },
+};
+
+#define HLDB_ENTRIES (sizeof(HLDB) / sizeof(HLDB[0]))
+
 /*** prototypes ***/
 void editorSetStatusMessage(const char *fmt, ...);
 void editorRefreshScreen();
 char *editorPrompt(char *prompt, void (*callback)(char *, int));
+void editorSaveProcessEvent();
+void editorFindRowChanged(int at);
+void editorFindRowsInserted(int at, int n);
+void editorFindRowsDeleted(int at, int n);
+void editorSyntaxIdle(int idle);
+void editorUndoInsert(int row, int col, int newrow, const char *text, size_t len);
+void editorUndoDelete(int row, int col, int endrow, int endcol, const char *text, size_t len, int bx, int by);
+struct undoRecord *editorUndoPush(int type, int flags, int row, int col, const char *text, size_t len);
+void editorJournalOp(int type, int flags, int row, int col, int endrow, int endcol,
+                     const char *text, size_t len);
+void editorJournalMark(int marked);
+void editorJournalReset(const char *filename);
 
 
 /*** terminal ***/
@@ -121,6 +450,8 @@ void die(const char *s) {
 }
 
 void disableRawMode() {
+    // bracketed pasteを無効にする
+    write(STDOUT_FILENO, "\x1b[?2004l", 8);
     if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &E.orig_termios) == -1)
         die("tcsetattr");
 }
@@ -138,61 +469,238 @@ void enableRawMode() {
     raw.c_cc[VTIME] = 1;
 
     if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1) die("tcsetattr");
+
+    // bracketed pasteを有効にする
+    // 貼り付けられた文字列が ESC[200~ と ESC[201~ で囲まれて送られてくる
+    write(STDOUT_FILENO, "\x1b[?2004h", 8);
 }
 
-int editorReadKey() {
-    int nread;
-    char c;
-    while ((nread = read(STDIN_FILENO, &c, 1)) != 1) {
-        if (nread == -1 && errno != EAGAIN) die("read");
-    }
-
-    if (c == '\x1b') {
-        // エスケープシーケンス(ESC)から始まる場合はさらに複数バイト読み取る
-        char seq[3];
-
-        // ESCの後に少なくとも2バイトあるはずで2バイト読む
-        if (read(STDIN_FILENO, &seq[0], 1) != 1) return '\x1b';
-        if (read(STDIN_FILENO, &seq[1], 1) != 1) return '\x1b';
-
-        if (seq[0] == '[') {
-            if (seq[1] >= '0' && seq[1] <= '9') {
-                // 3文字目を読む
-                if (read(STDIN_FILENO, &seq[2], 1) != 1) return '\x1b';
-                if (seq[2] == '~') {
-                    switch(seq[1]) {
-                        case '1': return HOME_KEY;     // ESC[1~ (in case of tmux)
-                        case '3': return DEL_KEY;      // ESC[3~
-                        case '4': return END_KEY;      // ESC[4~ (in case of tmux)
-                        case '5': return PAGE_UP;
-                        case '6': return PAGE_DOWN;
-                        case '7': return HOME_KEY;
-                        case '8': return END_KEY;
-                    }
-                }
+/* 入力のリングバッファ
+ * 1バイトずつreadせず、届いている分をまとめて1回のreadで読んでからここでキーに分解する */
+#define KILO_INPUT_BUF 65536 // 2の累乗
+#define KILO_ESC_TIMEOUT 100 // ESCの後に続きが来るのを待つ時間 (ms)
 
+struct {
+    char buf[KILO_INPUT_BUF];
+    unsigned int head; // 次に読む位置 (KILO_INPUT_BUFで割った余りが添字)
+    unsigned int tail; // 次に書く位置
+} input;
 
-            } else {
-                switch (seq[1]) {
-                    case 'A': return ARROW_UP; // up      ESC[A
-                    case 'B': return ARROW_DOWN; // down
-                    case 'C': return ARROW_RIGHT; // right
-                    case 'D': return ARROW_LEFT; // left
-                    case 'H': return HOME_KEY;   // (windows terminal, vscode, tabby)
-                    case 'F': return END_KEY;    // (windows terminal, vscode, tabby)
-                }
-            }
-        } else if (seq[0] == 'O') {
-            switch (seq[1]) {
-                case 'H': return HOME_KEY; // (? enviornment)
-                case 'F': return END_KEY;  // (? enviornment)
+int editorInputAvail() {
+    return input.tail - input.head;
+}
+
+int editorInputPeek(int i) {
+    return (unsigned char)input.buf[(input.head + i) & (KILO_INPUT_BUF - 1)];
+}
+
+void editorInputConsume(int n) {
+    input.head += n;
+}
+
+// timeoutミリ秒まで待ち (-1なら届くまで待つ)、届いている入力をまとめて読む
+// 空きが折り返している場合もreadvで1回のシステムコールで読む。読んだバイト数を返す
+int editorInputFill(int timeout) {
+    struct pollfd pfd = { STDIN_FILENO, POLLIN, 0 };
+    int space = KILO_INPUT_BUF - editorInputAvail();
+    if (space == 0)
+        return 0;
+    if (poll(&pfd, 1, timeout) <= 0)
+        return 0;
+
+    int pos = input.tail & (KILO_INPUT_BUF - 1);
+    int first = KILO_INPUT_BUF - pos;
+    if (first > space)
+        first = space;
+    struct iovec iov[2];
+    iov[0].iov_base = &input.buf[pos];
+    iov[0].iov_len = first;
+    iov[1].iov_base = input.buf;
+    iov[1].iov_len = space - first;
+    ssize_t nread = readv(STDIN_FILENO, iov, space > first ? 2 : 1);
+    if (nread == -1 && errno != EAGAIN && errno != EINTR) die("read");
+    if (nread <= 0)
+        return 0;
+    input.tail += nread;
+    return nread;
+}
+
+// ESC[200~ の後ろから ESC[201~ までをE.pasteに読み込む
+// ESCが出てくるまでは連続している部分をまとめてコピーする
+void editorReadPaste() {
+    const char *marker = "\x1b[201~";
+    int mlen = strlen(marker);
+
+    E.pastelen = 0;
+    while (1) {
+        // 終わりの印が来ないまま1秒止まったら、そこまでを貼り付けとして扱う
+        if (editorInputAvail() == 0 && editorInputFill(1000) == 0)
+            return;
+
+        unsigned int pos = input.head & (KILO_INPUT_BUF - 1);
+        size_t n = editorInputAvail();
+        if (n > KILO_INPUT_BUF - pos)
+            n = KILO_INPUT_BUF - pos;
+        char *esc = memchr(&input.buf[pos], '\x1b', n);
+        size_t take = esc ? (size_t)(esc - &input.buf[pos]) : n;
+        if (E.pastecap - E.pastelen < take + 1) {
+            while (E.pastecap - E.pastelen < take + 1)
+                E.pastecap = E.pastecap ? E.pastecap * 2 : KILO_INPUT_BUF;
+            E.paste = realloc(E.paste, E.pastecap);
+            if (E.paste == NULL) die("realloc");
+        }
+        memcpy(&E.paste[E.pastelen], &input.buf[pos], take);
+        E.pastelen += take;
+        editorInputConsume(take);
+        if (!esc)
+            continue;
+
+        // ESCが終わりの印かどうかは続きが全部届いてから判断する
+        if (editorInputAvail() < mlen) {
+            if (editorInputFill(1000) > 0)
+                continue;
+        } else {
+            int j;
+            for (j = 0; j < mlen && editorInputPeek(j) == (unsigned char)marker[j]; j++)
+                ;
+            if (j == mlen) {
+                editorInputConsume(mlen);
+                return;
             }
         }
+        // 終わりの印ではなかったESCは貼り付けの中身として扱う
+        E.paste[E.pastelen++] = '\x1b';
+        editorInputConsume(1);
+    }
+}
 
-        return '\x1b';
-    } else {
+// 入力の先頭i文字目を返す。まだ届いていなければESCの続きとしてしばらく待つ (来なければ-1)
+int editorInputPeekWait(int i) {
+    while (editorInputAvail() <= i)
+        if (editorInputFill(KILO_ESC_TIMEOUT) == 0) return -1;
+    return editorInputPeek(i);
+}
+
+// CSI (ESC [ 引数 終端文字) の終端文字に対応するキー
+int editorCsiKey(int final, int num) {
+    switch (final) {
+        case 'A': return ARROW_UP; // up      ESC[A
+        case 'B': return ARROW_DOWN; // down
+        case 'C': return ARROW_RIGHT; // right
+        case 'D': return ARROW_LEFT; // left
+        case 'H': return HOME_KEY;   // (windows terminal, vscode, tabby)
+        case 'F': return END_KEY;    // (windows terminal, vscode, tabby)
+        case '~':
+            switch (num) {
+                case 1: return HOME_KEY;     // ESC[1~ (in case of tmux)
+                case 3: return DEL_KEY;      // ESC[3~
+                case 4: return END_KEY;      // ESC[4~ (in case of tmux)
+                case 5: return PAGE_UP;
+                case 6: return PAGE_DOWN;
+                case 7: return HOME_KEY;
+                case 8: return END_KEY;
+            }
+    }
+    return '\x1b';
+}
+
+// 入力が届くまで待つ
+// 保存中は保存スレッドからの通知も待ち、届いたらメッセージバーを更新して描画する
+// プロンプトの入力中はメッセージバーを使っているので、通知は入力が終わってから読む
+// 待っている間はハイライトのスレッドに画面外の行の計算をさせる
+void editorInputWait() {
+    if (E.save == NULL || E.prompting) {
+        editorSyntaxIdle(1);
+        editorInputFill(-1);
+        editorSyntaxIdle(0);
+        return;
+    }
+    struct pollfd pfd[2] = {
+        { STDIN_FILENO, POLLIN, 0 },
+        { E.save->pipefd[0], POLLIN, 0 },
+    };
+    editorSyntaxIdle(1);
+    int n = poll(pfd, 2, -1);
+    editorSyntaxIdle(0);
+    if (n <= 0)
+        return;
+    if (pfd[1].revents) {
+        editorSaveProcessEvent();
+        editorRefreshScreen();
+    }
+    if (pfd[0].revents)
+        editorInputFill(0);
+}
+
+int editorReadKey() {
+    while (editorInputAvail() == 0)
+        editorInputWait();
+
+    int c = editorInputPeek(0);
+    if (c != '\x1b') {
+        editorInputConsume(1);
         return c;
     }
+
+    // エスケープシーケンス(ESC)から始まる場合は続きも見る
+    // 続きが来なければESCキー単体として扱う
+    int seq = editorInputPeekWait(1);
+    if (seq == '[') {
+        // CSI: ESC [ 数字;数字... 終端文字
+        // 修飾キー付き (ESC[1;5A は Ctrl+↑) の場合は修飾を無視して元のキーとして扱う
+        int params[4] = { 0 };
+        int nparams = 0;
+        int i = 2;
+        int ch;
+        while ((ch = editorInputPeekWait(i)) != -1 &&
+               ((ch >= '0' && ch <= '9') || ch == ';')) {
+            if (ch == ';') {
+                nparams++;
+            } else if (nparams < 4) {
+                params[nparams] = params[nparams] * 10 + (ch - '0');
+            }
+            i++;
+        }
+        if (ch == -1) {
+            editorInputConsume(1);
+            return '\x1b';
+        }
+        editorInputConsume(i + 1);
+        if (ch == '~' && params[0] == 200) { // ESC[200~ 貼り付けの開始
+            editorReadPaste();
+            return PASTE;
+        }
+        return editorCsiKey(ch, params[0]);
+    } else if (seq == 'O') {
+        // SS3: ESC O 文字
+        int ch = editorInputPeekWait(2);
+        if (ch == -1) {
+            editorInputConsume(1);
+            return '\x1b';
+        }
+        editorInputConsume(3);
+        switch (ch) {
+            case 'H': return HOME_KEY; // (? enviornment)
+            case 'F': return END_KEY;  // (? enviornment)
+        }
+        return '\x1b';
+    }
+
+    editorInputConsume(seq == -1 ? 1 : 2);
+    return '\x1b';
+}
+
+// timeoutミリ秒以内に入力が届くか (0なら待たずに今届いているかだけ見る)
+int editorInputPending(int timeout) {
+    if (editorInputAvail() > 0)
+        return 1;
+    return editorInputFill(timeout) > 0;
+}
+
+long long editorNowMs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
 }
 
 int getCursorPosition(int *rows, int *cols) {
@@ -246,45 +754,538 @@ int getWindowSize(int *rows, int *cols) {
 
 /*** syntax highlighting ***/
 
-int is_separator(int c) {
-    return isspace(c) || c == '\0' || strchr(",.()+-/*=~%<>[];", c) != NULL;
+// renderで文字cの次の位置
+int editorRenderAdvance(int rx, char c) {
+    if (c == '\t')
+        return rx + KILO_TAB_STOP - (rx % KILO_TAB_STOP);
+    return rx + 1;
 }
 
-void editorUpdateSyntax(erow *row) {
-    row->hl = realloc(row->hl, row->rsize);
-    memset(row->hl, HL_NORMAL, row->rsize);
+// キーワードのハッシュ (FNV-1a)。seedを変えて完全ハッシュになるものを探す
+unsigned int editorKeywordHash(const char *s, int len, unsigned int seed) {
+    unsigned int h = seed;
+    int i;
+    for (i = 0; i < len; i++)
+        h = (h ^ (unsigned char)s[i]) * 16777619u;
+    return h ^ (h >> 16);
+}
+
+// syntax->keywordsから衝突の無いハッシュ表を作る
+// 表の大きさをキーワード数の2倍以上の2の累乗から始め、seedが見つからなければ倍にする
+void editorSyntaxKeywords(struct editorSyntax *syntax) {
+    int n = 0;
+    while (syntax->keywords[n]) n++;
+
+    unsigned int size = 1;
+    while (size < (unsigned int)n * 2) size <<= 1;
+    for (;;) {
+        struct editorKeyword *tab = calloc(size, sizeof(*tab));
+        if (tab == NULL) die("calloc");
+        unsigned int seed;
+        for (seed = 2166136261u; seed != 2166136261u + 4096; seed++) {
+            int j;
+            for (j = 0; j < n; j++) {
+                const char *w = syntax->keywords[j];
+                int len = strlen(w);
+                int kw2 = w[len - 1] == '|';
+                if (kw2) len--;
+                struct editorKeyword *k = &tab[editorKeywordHash(w, len, seed) & (size - 1)];
+                if (k->len)
+                    break;
+                k->word = w;
+                k->len = len;
+                k->hl = kw2 ? HL_KEYWORD2 : HL_KEYWORD1;
+            }
+            if (j == n)
+                break;
+            memset(tab, 0, size * sizeof(*tab));
+        }
+        if (seed == 2166136261u + 4096) {
+            free(tab);
+            size <<= 1;
+            continue;
+        }
 
-    // 変数名の数値などを除外しつつハイライトを設定
+        syntax->kwtab = tab;
+        syntax->kwmask = size - 1;
+        syntax->kwseed = seed;
+        syntax->kwmin = syntax->kwmax = 0;
+        unsigned int j;
+        for (j = 0; j < size; j++) {
+            if (tab[j].len == 0) continue;
+            if (syntax->kwmin == 0 || tab[j].len < syntax->kwmin) syntax->kwmin = tab[j].len;
+            if (tab[j].len > syntax->kwmax) syntax->kwmax = tab[j].len;
+        }
+        return;
+    }
+}
+
+// s[0..len)がキーワードならHL_KEYWORD1/2、違えばHL_NORMALを返す
+int editorSyntaxKeyword(struct editorSyntax *syntax, const char *s, int len) {
+    if (len < syntax->kwmin || len > syntax->kwmax)
+        return HL_NORMAL;
+    struct editorKeyword *k =
+        &syntax->kwtab[editorKeywordHash(s, len, syntax->kwseed) & syntax->kwmask];
+    if (k->len == len && !memcmp(k->word, s, len))
+        return k->hl;
+    return HL_NORMAL;
+}
+
+// editorSyntaxScanの本体。s[*at]から読み始めて、s[*at, len)にハイライトを付ける
+// *atは行頭 (状態はin) か、区切り文字を普通の文字として読んだ直後 (inは0) の位置にする
+// (どちらも文字列・コメントの外で、直前が区切り文字という同じ状態になる)
+// stop >= 0の時は、stop以降で区切り文字を普通の文字として読む所に来たら、
+// その文字を読む前に*atをその位置にして-1を返す。hl[*at]はまだ書き換えていない
+// 行末まで読んだら*atをlenにして行末の状態を返す
+int editorSyntaxScanFrom(const char *s, int len, int *at, int in, unsigned char *hl, int stop) {
+    struct editorSyntax *syntax = E.syntax;
+    const unsigned char *cc = syntax->classes;
+
+    char *scs = syntax->singleline_comment_start;
+    char *mcs = syntax->multiline_comment_start;
+    char *mce = syntax->multiline_comment_end;
+    int scs_len = scs ? strlen(scs) : 0;
+    int mcs_len = mcs ? strlen(mcs) : 0;
+    int mce_len = mce ? strlen(mce) : 0;
+    if (mcs_len == 0 || mce_len == 0)
+        mcs_len = mce_len = 0;
+
+    int start = *at;
     int prev_sep = 1;
+    int in_string = 0;
+    int in_comment = mce_len ? in : 0;
+
+    int i = start;
+    while (i < len) {
+        // 複数行コメントの中は終わりを探すだけ
+        if (in_comment) {
+            int j = i;
+            for (;;) {
+                const char *p = memchr(&s[j], mce[0], len - j);
+                if (p == NULL) {
+                    j = len;
+                    break;
+                }
+                j = p - s;
+                if (len - j >= mce_len && !memcmp(&s[j], mce, mce_len)) {
+                    j += mce_len;
+                    in_comment = 0;
+                    prev_sep = 1;
+                    break;
+                }
+                j++;
+            }
+            if (hl) memset(&hl[i], HL_MLCOMMENT, j - i);
+            i = j;
+            continue;
+        }
 
-    int i = 0;
-    while (i < row->rsize) {
-        char c = row->render[i];
-        unsigned char prev_hl = (i > 0) ? row->hl[i - 1] : HL_NORMAL;
+        // 文字列の中は閉じる引用符を探すだけ (\の次の文字は飛ばす)
+        if (in_string) {
+            int j = i;
+            while (j < len && s[j] != in_string) {
+                if (s[j] == '\\' && j + 1 < len) j++;
+                j++;
+            }
+            if (j < len) {
+                j++;
+                in_string = 0;
+            }
+            if (hl) memset(&hl[i], HL_STRING, j - i);
+            i = j;
+            prev_sep = 1;
+            continue;
+        }
+
+        unsigned char c = s[i];
+        int cls = cc[c];
+
+        // コメント
+        if (cls & CC_COMMENT) {
+            if (scs_len && len - i >= scs_len && !memcmp(&s[i], scs, scs_len)) {
+                if (hl) memset(&hl[i], HL_COMMENT, len - i);
+                break;
+            }
+            if (mcs_len && len - i >= mcs_len && !memcmp(&s[i], mcs, mcs_len)) {
+                if (hl) memset(&hl[i], HL_MLCOMMENT, mcs_len);
+                i += mcs_len;
+                in_comment = 1;
+                continue;
+            }
+        }
+
+        // 文字列
+        if ((cls & CC_QUOTE) && (syntax->flags & HL_HIGHLIGHT_STRINGS)) {
+            in_string = c;
+            if (hl) hl[i] = HL_STRING;
+            i++;
+            continue;
+        }
+
+        if (hl == NULL) {
+            i++;
+            while (i < len && !(cc[(unsigned char)s[i]] & (CC_COMMENT | CC_QUOTE)))
+                i++;
+            continue;
+        }
 
-        if ((isdigit(c) && (prev_sep || prev_hl == HL_NUMBER)) ||
-            (c == '.' && prev_hl == HL_NUMBER)) {
-            row->hl[i] = HL_NUMBER;
+        // 変数名の数値などを除外しつつハイライトを設定
+        unsigned char prev_hl = i > start ? hl[i - 1] : HL_NORMAL;
+        if ((syntax->flags & HL_HIGHLIGHT_NUMBERS) &&
+            (((cls & CC_DIGIT) && (prev_sep || prev_hl == HL_NUMBER)) ||
+             (c == '.' && prev_hl == HL_NUMBER))) {
+            hl[i] = HL_NUMBER;
             i++;
             prev_sep = 0;
             continue;
         }
 
-        prev_sep = is_separator(c);
+        // キーワードは区切り文字で挟まれている場合だけ
+        // 区切り文字までを1単語として表を引き、キーワードでなくても
+        // 中にコメントや文字列の開始文字が無ければ単語ごと飛ばす
+        if (prev_sep && !(cls & CC_SEPARATOR)) {
+            int j = i + 1;
+            int inner = cls;
+            while (j < len && !(cc[(unsigned char)s[j]] & CC_SEPARATOR))
+                inner |= cc[(unsigned char)s[j++]];
+            int kw = editorSyntaxKeyword(syntax, &s[i], j - i);
+            if (kw != HL_NORMAL) {
+                memset(&hl[i], kw, j - i);
+                i = j;
+                prev_sep = 0;
+                continue;
+            }
+            if (!(inner & (CC_COMMENT | CC_QUOTE))) {
+                memset(&hl[i], HL_NORMAL, j - i);
+                i = j;
+                prev_sep = 0;
+                continue;
+            }
+        }
+
+        prev_sep = cls & CC_SEPARATOR;
+        if (prev_sep && stop >= 0 && i >= stop) {
+            *at = i;
+            return -1;
+        }
+        hl[i] = HL_NORMAL;
         i++;
     }
+    *at = len;
+    return in_comment;
+}
+
+// charsのlenバイトにハイライトを付け、行末の状態 (複数行コメントが閉じていなければ1) を返す
+// inは行頭の状態 (前の行の行末の状態)。hlがNULLなら状態だけを計算する
+// (数値とキーワードは状態に影響しないので、コメントと文字列の開始文字まで飛ばす)
+// 文字の判定はsyntax->classesの表を引くだけで、キーワードは単語ごとに1回ハッシュを引く
+int editorSyntaxScan(const char *s, int len, int in, unsigned char *hl) {
+    int at = 0;
+    return editorSyntaxScanFrom(s, len, &at, in, hl, -1);
+}
+
+// charsの位置でハイライトを付けるための作業領域 (タブを含む行はrenderの位置に広げて使う)
+unsigned char *editorSyntaxBuffer(int n) {
+    static unsigned char *chl = NULL;
+    static int chlcap = 0;
+    if (n > chlcap) {
+        chlcap = n * 2;
+        chl = realloc(chl, chlcap);
+        if (chl == NULL) die("realloc");
+    }
+    return chl;
+}
+
+// row->hl_inから始めてhlとhl_ocを作り直す
+// ハイライトはcharsに付けてから、タブの分を広げてrenderに合わせる
+void editorUpdateSyntax(erow *row) {
+    erender *r = row->r;
+    row->flags &= ~ROW_HL_STALE;
+    if (E.syntax == NULL) {
+        memset(r->hl, HL_NORMAL, r->rsize);
+        row->hl_oc = 0;
+        return;
+    }
+    if (r->rsize == row->size) { // タブが無い
+        row->hl_oc = editorSyntaxScan(row->chars, row->size, row->hl_in, r->hl);
+        return;
+    }
+
+    unsigned char *chl = editorSyntaxBuffer(row->size);
+    row->hl_oc = editorSyntaxScan(row->chars, row->size, row->hl_in, chl);
+    int rx = 0;
+    int j;
+    for (j = 0; j < row->size; j++) {
+        int next = editorRenderAdvance(rx, row->chars[j]);
+        memset(&r->hl[rx], chl[j], next - rx);
+        rx = next;
+    }
+}
+
+// 行のat文字目以降が変わった時に、hlを変わった所の辺りだけ付け直す
+// stop文字目以降のhlには編集前のものが (編集後の位置にずらして) 入っている
+// 編集位置の手前で区切り文字を普通の文字として読んだ所から読み始め、stop以降で
+// また区切り文字を普通の文字として読む所に来た時、そこが編集前も普通の文字だったら止める
+// (そこから先は編集前と同じ文字を同じ状態で読むことになるので、hlもhl_ocも変わらない)
+void editorUpdateSyntaxFrom(erow *row, int at, int stop) {
+    struct editorSyntax *syntax = E.syntax;
+    const unsigned char *cc = syntax->classes;
+    erender *r = row->r;
+    const char *s = row->chars;
+    int flat = r->rsize == row->size; // hlがcharsと同じ位置 (タブが無い)
+
+    // 読み始める位置p。p - 1の文字を読む時にコメントの開始を先読みするので、
+    // 先読みが編集位置にかからない所まで戻る
+    int ahead = 1;
+    if (syntax->singleline_comment_start && (int)strlen(syntax->singleline_comment_start) > ahead)
+        ahead = strlen(syntax->singleline_comment_start);
+    if (syntax->multiline_comment_start && (int)strlen(syntax->multiline_comment_start) > ahead)
+        ahead = strlen(syntax->multiline_comment_start);
+    int p = 0, prx = 0;
+    int k;
+    if (flat) {
+        for (k = at - ahead; k >= 0; k--) {
+            if ((cc[(unsigned char)s[k]] & CC_SEPARATOR) && r->hl[k] == HL_NORMAL) {
+                p = prx = k + 1;
+                break;
+            }
+        }
+    } else {
+        // タブがあるとrenderの位置は前からしか分からない
+        int rx = 0;
+        for (k = 0; k + ahead <= at; k++) {
+            int next = editorRenderAdvance(rx, s[k]);
+            if ((cc[(unsigned char)s[k]] & CC_SEPARATOR) && r->hl[rx] == HL_NORMAL) {
+                p = k + 1;
+                prx = next;
+            }
+            rx = next;
+        }
+    }
+
+    unsigned char *chl = editorSyntaxBuffer(row->size);
+    int i = p;
+    int in = p == 0 ? row->hl_in : 0;
+    int ck = p, crx = prx; // 編集前のhlを見るための、charsの位置とrenderの位置の組
+    int oc;
+    for (;;) {
+        oc = editorSyntaxScanFrom(s, row->size, &i, in, chl, stop);
+        if (oc != -1)
+            break;
+        while (ck < i)
+            crx = editorRenderAdvance(crx, s[ck++]);
+        if (r->hl[crx] == HL_NORMAL)
+            break; // 編集前もここは普通の文字だったので、ここから先は変わらない
+        chl[i++] = HL_NORMAL;
+        in = 0;
+    }
+
+    // 付け直した[p, i)をhlに書き戻す
+    if (flat) {
+        if (i > p)
+            memcpy(&r->hl[p], &chl[p], i - p);
+    } else {
+        int rx = prx;
+        for (k = p; k < i; k++) {
+            int next = editorRenderAdvance(rx, s[k]);
+            memset(&r->hl[rx], chl[k], next - rx);
+            rx = next;
+        }
+    }
+    if (oc != -1)
+        row->hl_oc = oc;
+    row->flags &= ~ROW_HL_STALE;
 }
 
 // row->hlをANSI colorに変換する
 // ref: https://en.wikipedia.org/wiki/ANSI_escape_code#SGR_(Select_Graphic_Rendition)_parameters
 int editorSyntaxToColor(int hl) {
     switch (hl) {
+        case HL_COMMENT:
+        case HL_MLCOMMENT: return 36; // cyan
+        case HL_KEYWORD1: return 33; // yellow
+        case HL_KEYWORD2: return 32; // green
+        case HL_STRING: return 35; // magenta
         case HL_NUMBER: return 31; // red
         case HL_MATCH: return 34; // blue
+        case HL_STATUSBAR: return 7; // reverse
         default: return 37; // white
     }
 }
 
+// hlの色を付けるエスケープシーケンス (ESC[0;色m) を返す
+// 描画のたびにsnprintfしないよう、作ったものは取っておく
+const char *editorSyntaxToEscape(int hl, int *len) {
+    static char esc[256][16];
+    static int esclen[256];
+    if (esclen[hl] == 0)
+        esclen[hl] = snprintf(esc[hl], sizeof(esc[hl]), "\x1b[0;%dm", editorSyntaxToColor(hl));
+    *len = esclen[hl];
+    return esc[hl];
+}
+
+/*** row storage ***/
+
+// at行目のerowを返す
+static inline erow *editorRow(int at) {
+    return E.row[at < E.gap ? at : at + (E.rowcap - E.numrows)];
+}
+
+// ギャップの開始位置をatに動かす。動かした距離の分だけmemmoveする
+void editorRowGapMove(int at) {
+    int gaplen = E.rowcap - E.numrows;
+    if (at < E.gap)
+        memmove(&E.row[at + gaplen], &E.row[at], sizeof(erow *) * (E.gap - at));
+    else if (at > E.gap)
+        memmove(&E.row[E.gap], &E.row[E.gap + gaplen], sizeof(erow *) * (at - E.gap));
+    E.gap = at;
+}
+
+// ギャップにn行分の空きを作る。足りなければ倍々で広げる
+void editorRowGapReserve(int n) {
+    if (E.rowcap - E.numrows >= n)
+        return;
+    int newcap = E.rowcap ? E.rowcap * 2 : 64;
+    while (newcap - E.numrows < n)
+        newcap *= 2;
+    int tail = E.numrows - E.gap; // ギャップより後ろの行数
+    E.row = realloc(E.row, sizeof(erow *) * newcap);
+    if (E.row == NULL) die("realloc");
+    memmove(&E.row[newcap - tail], &E.row[E.rowcap - tail], sizeof(erow *) * tail);
+    E.rowcap = newcap;
+}
+
+// erowとerenderは固定長なのでまとめて確保し、解放されたものはフリーリストで使い回す
+// (1000万行のファイルでも1行ごとにmallocしない)
+// 解放されたものは先頭をフリーリストの次へのポインタとして使う
+// かたまりの先頭から順に渡すので、開いた時に作る行はファイルの順にメモリ上に並び、
+// 全行をたどる処理はメモリを前から順に読むことになる
+#define EROW_POOL_CHUNK 4096
+#define ERENDER_POOL_CHUNK 256
+
+void *erow_freelist = NULL;
+void *erender_freelist = NULL;
+
+void *editorPoolAlloc(void **freelist, size_t size, int n) {
+    if (*freelist == NULL) {
+        char *chunk = malloc(size * n);
+        if (chunk == NULL) die("malloc");
+        int j;
+        for (j = n - 1; j >= 0; j--) {
+            *(void **)(chunk + size * j) = *freelist;
+            *freelist = chunk + size * j;
+        }
+    }
+    void *p = *freelist;
+    *freelist = *(void **)p;
+    return p;
+}
+
+void editorPoolFree(void **freelist, void *p) {
+    *(void **)p = *freelist;
+    *freelist = p;
+}
+
+erow *editorAllocRow() {
+    return editorPoolAlloc(&erow_freelist, sizeof(erow), EROW_POOL_CHUNK);
+}
+
+void editorReleaseRow(erow *row) {
+    editorPoolFree(&erow_freelist, row);
+}
+
+erender *editorAllocRender() {
+    return editorPoolAlloc(&erender_freelist, sizeof(erender), ERENDER_POOL_CHUNK);
+}
+
+void editorReleaseRender(erender *r) {
+    editorPoolFree(&erender_freelist, r);
+}
+
+// 行のバッファ (chars、renderとhlをまとめた領域) のアロケータ
+// 2の累乗のサイズクラスごとにSLAB_CHUNKのかたまりから切り出し、解放されたものは
+// クラスごとのフリーリストで使い回す。SLAB_MAXより大きいものだけmallocする
+// 解放する時は確保した大きさを渡す (ヘッダーを持たないので1バイトも無駄にしない)
+// メインスレッドからだけ使う
+// SLAB_MAXを0にしてコンパイルするとすべてmallocする (make benchで比べるため)
+#define SLAB_MIN 16
+#ifndef SLAB_MAX
+#define SLAB_MAX 4096
+#endif
+#define SLAB_CLASSES 9 // 16, 32, ..., 4096
+#define SLAB_CHUNK (64 << 10)
+
+void *slab_freelist[SLAB_CLASSES];
+
+// nバイトを確保すると実際に使える大きさ
+size_t editorSlabSize(size_t n) {
+    if (n > SLAB_MAX)
+        return n;
+    size_t size = SLAB_MIN;
+    while (size < n)
+        size <<= 1;
+    return size;
+}
+
+int editorSlabClass(size_t n) {
+    int c = 0;
+    size_t size = SLAB_MIN;
+    while (size < n) {
+        size <<= 1;
+        c++;
+    }
+    return c;
+}
+
+void *editorSlabAlloc(size_t n) {
+    if (n > SLAB_MAX) {
+        void *p = malloc(n);
+        if (p == NULL) die("malloc");
+        return p;
+    }
+    int c = editorSlabClass(n);
+    if (slab_freelist[c] == NULL) {
+        size_t size = (size_t)SLAB_MIN << c;
+        char *chunk = malloc(SLAB_CHUNK);
+        if (chunk == NULL) die("malloc");
+        size_t off;
+        for (off = 0; off + size <= SLAB_CHUNK; off += size) {
+            *(void **)(chunk + off) = slab_freelist[c];
+            slab_freelist[c] = chunk + off;
+        }
+    }
+    void *p = slab_freelist[c];
+    slab_freelist[c] = *(void **)p;
+    return p;
+}
+
+void editorSlabFree(void *p, size_t n) {
+    if (p == NULL)
+        return;
+    if (n > SLAB_MAX) {
+        free(p);
+        return;
+    }
+    int c = editorSlabClass(n);
+    *(void **)p = slab_freelist[c];
+    slab_freelist[c] = p;
+}
+
+// oldnバイトの領域をnewnバイトにする (同じサイズクラスならそのまま)
+void *editorSlabRealloc(void *p, size_t oldn, size_t newn) {
+    if (oldn > SLAB_MAX && newn > SLAB_MAX) {
+        p = realloc(p, newn);
+        if (p == NULL) die("realloc");
+        return p;
+    }
+    if (editorSlabSize(oldn) == editorSlabSize(newn))
+        return p;
+    void *q = editorSlabAlloc(newn);
+    memcpy(q, p, oldn < newn ? oldn : newn);
+    editorSlabFree(p, oldn);
+    return q;
+}
+
 /*** row operations ***/
 
 int editorRowCxToRx(erow *row, int cx) {
@@ -313,294 +1314,2778 @@ int editorRowRxToCx(erow *row, int rx) {
     return cx;
 }
 
-void editorUpdateRow(erow *row) {
+// renderとhlの領域を解放する
+void editorRowFreeRender(erow *row) {
+    erender *r = row->r;
+    if (row->flags & ROW_RENDER_CHARS)
+        editorSlabFree(r->hl, r->rcap);
+    else
+        editorSlabFree(r->render, 2 * r->rcap);
+    row->flags &= ~ROW_RENDER_CHARS;
+}
+
+// charsからrenderとhlを作る
+void editorBuildRender(erow *row) {
+    erender *r = row->r;
     int tabs = 0;
     int j;
     for (j = 0; j < row->size; j++)
         if (row->chars[j] == '\t') tabs++;
 
-    free(row->render);
-    row->render = malloc(row->size + tabs*(KILO_TAB_STOP - 1) + 1); // タブ文字を考えて最大限の文字数を確保する
+    editorRowFreeRender(row);
+    if (tabs == 0) {
+        // タブが無ければrenderはcharsと同じなので、コピーせずにcharsを指す
+        // ほとんどの行はタブを含まないので、行ごとのメモリとコピーが半分で済む
+        row->flags |= ROW_RENDER_CHARS;
+        r->rcap = editorSlabSize(row->size + 1);
+        r->hl = editorSlabAlloc(r->rcap);
+        r->render = row->chars;
+        r->rsize = row->size;
+        editorUpdateSyntax(row);
+        return;
+    }
+
+    // タブ文字を考えて最大限の文字数を確保する。hlも同じ大きさで後ろに続ける
+    int need = row->size + tabs*(KILO_TAB_STOP - 1) + 1;
+    r->rcap = editorSlabSize(2 * need) / 2;
+    r->render = editorSlabAlloc(2 * r->rcap);
+    r->hl = (unsigned char *)r->render + r->rcap;
 
     int idx = 0;
     for (j = 0; j < row->size; j++) {
         // TAB文字をスペース8つに変換
         if (row->chars[j] == '\t') {
-            row->render[idx++] = ' ';
-            while (idx % KILO_TAB_STOP != 0) row->render[idx++] = ' ';
+            r->render[idx++] = ' ';
+            while (idx % KILO_TAB_STOP != 0) r->render[idx++] = ' ';
         } else {
-            row->render[idx++] = row->chars[j];
+            r->render[idx++] = row->chars[j];
         }
     }
-    row->render[idx] = '\0';
-    row->rsize = idx; // タブの文字数とかの分がsizeより増えることになる
+    r->render[idx] = '\0';
+    r->rsize = idx; // タブの文字数とかの分がsizeより増えることになる
 
     // syntax highlight (色づけ)のためのデータを更新する
     editorUpdateSyntax(row);
 }
 
-void editorInsertRow(int at, char *s, size_t len) {
-    if (at < 0 || at > E.numrows)
-        return;
-
-    // 行をappendする
-    E.row = realloc(E.row, sizeof(erow) * (E.numrows + 1));
-    memmove(&E.row[at + 1], &E.row[at], sizeof(erow) * (E.numrows - at));
+void editorLruUnlink(erender *r) {
+    if (r->lru_prev) r->lru_prev->lru_next = r->lru_next;
+    else E.lru_head = r->lru_next;
+    if (r->lru_next) r->lru_next->lru_prev = r->lru_prev;
+    else E.lru_tail = r->lru_prev;
+}
 
-    E.row[at].size = len;
-    E.row[at].chars = malloc(len + 1); // 1バイトはnull文字
-    memcpy(E.row[at].chars, s, len);
-    E.row[at].chars[len] = '\0';
+void editorLruPushFront(erender *r) {
+    r->lru_prev = NULL;
+    r->lru_next = E.lru_head;
+    if (E.lru_head) E.lru_head->lru_prev = r;
+    else E.lru_tail = r;
+    E.lru_head = r;
+}
 
-    E.row[at].rsize = 0;
-    E.row[at].render = NULL;
-    E.row[at].hl = NULL;
-    editorUpdateRow(&E.row[at]);
+// renderとhlを捨てる。次に必要になった時にeditorRowMaterializeで作り直す
+void editorRowDropRender(erow *row) {
+    erender *r = row->r;
+    if (r == NULL)
+        return;
+    editorLruUnlink(r);
+    editorRowFreeRender(row);
+    editorReleaseRender(r);
+    row->r = NULL;
+    E.nrendered--;
+}
 
-    E.numrows++;
-    E.dirty++;
+// renderとhlを使う前に呼ぶ。無ければ作り、上限を超えたら一番使われていない行から捨てる
+void editorRowMaterialize(erow *row) {
+    if (row->r != NULL) {
+        editorLruUnlink(row->r);
+        editorLruPushFront(row->r);
+        return;
+    }
+    erender *r = editorAllocRender();
+    r->rsize = 0;
+    r->rcap = 0;
+    r->render = NULL;
+    r->hl = NULL;
+    r->row = row;
+    row->r = r;
+    editorBuildRender(row);
+    editorLruPushFront(r);
+    E.nrendered++;
+
+    // 画面に出ている行は捨てないよう、上限は最低でも画面の行数にする
+    int limit = KILO_RENDER_CACHE > E.screenrows ? KILO_RENDER_CACHE : E.screenrows;
+    while (E.nrendered > limit)
+        editorRowDropRender(E.lru_tail->row);
 }
 
-void editorFreeRow(erow *row) {
-    free(row->render);
-    free(row->chars);
-    free(row->hl);
+// 行[0, at)のhl_ocを計算して、行atの行頭の状態を確定させる
+// 前回と行頭の状態が同じでcharsも変わっていない行は計算し直さないので、
+// 編集でhl_ocが変わっても、変化が止まった所から後ろは行をたどるだけで済む
+void editorSyntaxAdvance(int at) {
+    if (at > E.numrows)
+        at = E.numrows;
+    while (E.hl_frontier < at) {
+        erow *row = editorRow(E.hl_frontier);
+        int in = E.hl_frontier > 0 ? editorRow(E.hl_frontier - 1)->hl_oc : 0;
+        if ((row->flags & ROW_HL_STALE) || row->hl_in != in) {
+            row->hl_in = in;
+            if (row->r)
+                editorUpdateSyntax(row);
+            else if (E.syntax)
+                row->hl_oc = editorSyntaxScan(row->chars, row->size, in, NULL);
+            else
+                row->hl_oc = 0;
+            row->flags &= ~ROW_HL_STALE;
+        }
+        E.hl_frontier++;
+    }
+}
+
+// 行atが編集されたので、そこから後ろのhl_ocを当てにしないようにする
+void editorSyntaxInvalidate(int at) {
+    if (at < E.hl_frontier)
+        E.hl_frontier = at;
+}
+
+// メインスレッドが入力を待っている間にhl_frontierを最後の行まで進めておくスレッド
+// 画面に出る行は描画時に同期的に計算するので、ここでは画面外の行の分を先回りして済ませ、
+// 大きなファイルで複数行コメントを開け閉めした後のスクロールや移動を速くする
+// 行ごとのhl_inとROW_HL_STALEで計算済みかどうかが分かるので、
+// 途中でメインスレッドに譲っても、戻ってきたら続きから進めればよい
+void *editorSyntaxThread(void *arg) {
+    (void)arg;
+#ifdef SCHED_IDLE
+    // 他に動くものがない時だけ動かす
+    struct sched_param sp = { 0 };
+    pthread_setschedparam(pthread_self(), SCHED_IDLE, &sp);
+#endif
+    pthread_mutex_lock(&E.hl_mutex);
+    for (;;) {
+        while (!E.hl_idle || E.syntax == NULL || E.hl_frontier >= E.numrows ||
+               __atomic_load_n(&E.hl_pause, __ATOMIC_ACQUIRE))
+            pthread_cond_wait(&E.hl_cond, &E.hl_mutex);
+        // 1行ごとにメインスレッドが戻ってきていないか見る
+        while (E.hl_frontier < E.numrows && !__atomic_load_n(&E.hl_pause, __ATOMIC_ACQUIRE))
+            editorSyntaxAdvance(E.hl_frontier + 1);
+    }
+    return NULL;
+}
+
+// メインスレッドが入力を待つ前に1、待ち終わったら0で呼ぶ
+void editorSyntaxIdle(int idle) {
+    if (idle) {
+        E.hl_idle = 1;
+        pthread_cond_signal(&E.hl_cond);
+        pthread_mutex_unlock(&E.hl_mutex);
+    } else {
+        // ハイライトのスレッドに今の行で止まってもらってから取り戻す
+        __atomic_store_n(&E.hl_pause, 1, __ATOMIC_RELEASE);
+        pthread_mutex_lock(&E.hl_mutex);
+        E.hl_idle = 0;
+        __atomic_store_n(&E.hl_pause, 0, __ATOMIC_RELEASE);
+    }
+}
+
+// ハイライトのスレッドを起動する。メインスレッドはhl_mutexを持った状態になる
+// 起動できなければ今まで通り必要になった時に計算するだけ
+void editorSyntaxStart() {
+    pthread_mutex_init(&E.hl_mutex, NULL);
+    pthread_cond_init(&E.hl_cond, NULL);
+    E.hl_idle = 0;
+    E.hl_pause = 0;
+    pthread_mutex_lock(&E.hl_mutex);
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, editorSyntaxThread, NULL) == 0)
+        pthread_detach(thread);
+}
+
+// 行atのrenderとhlを使う前に呼ぶ。行頭の状態を確定させてから作る
+erow *editorRowHighlighted(int at) {
+    editorSyntaxAdvance(at + 1);
+    erow *row = editorRow(at);
+    editorRowMaterialize(row);
+    return row;
+}
+
+// 編集操作の後に呼び、行番号で覚えているもの (ハイライトの状態と検索結果) を更新する
+void editorRowChanged(int at) {
+    editorSyntaxInvalidate(at);
+    editorFindRowChanged(at);
+}
+
+void editorRowsInserted(int at, int n) {
+    editorSyntaxInvalidate(at);
+    editorFindRowsInserted(at, n);
+}
+
+void editorRowsDeleted(int at, int n) {
+    editorSyntaxInvalidate(at);
+    editorFindRowsDeleted(at, n);
+}
+
+// charsが変わった時に呼ぶ。renderとhlは次に使われる時に作り直す
+void editorUpdateRow(erow *row) {
+    row->flags |= ROW_HL_STALE;
+    editorRowDropRender(row);
+}
+
+// editorUpdateRowFromのうちrenderがcharsを指している行の場合
+// renderは作り直さなくてよいので、hlをずらして付け直すだけで済む
+void editorUpdateSharedRow(erow *row, int at, int newlen, int oldlen) {
+    erender *r = row->r;
+    r->render = row->chars;
+    if (newlen > 0 && memchr(&row->chars[at], '\t', newlen)) {
+        // タブが入ったのでrenderを別に作る
+        editorBuildRender(row);
+        return;
+    }
+    if (row->size + 1 > r->rcap) {
+        // 1文字ずつ伸びても作り直しが償却O(1)回になるよう倍々で広げる
+        int rcap = r->rcap * 2 > row->size + 1 ? r->rcap * 2 : row->size + 1;
+        r->hl = editorSlabRealloc(r->hl, r->rcap, rcap);
+        r->rcap = editorSlabSize(rcap);
+    }
+    memmove(&r->hl[at + newlen], &r->hl[at + oldlen], r->rsize - at - oldlen);
+    r->rsize = row->size;
+
+    if (E.syntax)
+        editorUpdateSyntaxFrom(row, at, at + newlen);
+    else
+        memset(&r->hl[at], HL_NORMAL, newlen);
+}
+
+// chars[at]からoldlenバイトをnewlenバイトに置き換えた後に呼び、
+// renderとhlを編集位置から必要な所までだけ作り直す
+// oldtabは消したoldlenバイトにタブがあったか (消した文字列そのものは渡さなくてよいように)
+// 編集位置から次のタブまでを作り直せば、それより後ろは元のrenderの平行移動になる
+// (タブの後ろでは新旧のずれがKILO_TAB_STOPの倍数になり、それ以降は変わらないため)
+void editorUpdateRowFrom(erow *row, int at, int newlen, int oldlen, int oldtab) {
+    erender *r = row->r;
+    row->flags |= ROW_HL_STALE;
+    if (r == NULL)
+        return; // 作られていなければ次に使われる時に作る
+    if (row->flags & ROW_RENDER_CHARS) {
+        editorUpdateSharedRow(row, at, newlen, oldlen);
+        return;
+    }
+    if (oldtab) {
+        // タブを消した時は全体を作り直す (消した部分のrender上の幅が分からないのと、
+        // 最後のタブを消したのならcharsを指す形に戻すため)
+        editorBuildRender(row);
+        return;
+    }
+
+    int rx = editorRowCxToRx(row, at);
+    int oldrx = rx + oldlen; // 消した部分にタブは無い
+    int newrx = rx;
+    int j;
+    for (j = at; j < at + newlen; j++)
+        newrx = editorRenderAdvance(newrx, row->chars[j]);
+    while (j < row->size && newrx != oldrx) {
+        char c = row->chars[j++];
+        newrx = editorRenderAdvance(newrx, c);
+        oldrx = editorRenderAdvance(oldrx, c);
+        if (c == '\t')
+            break;
+    }
+
+    // 変わっていない後ろ側をずらす
+    int rsize = r->rsize + (newrx - oldrx);
+    if (rsize + 1 > r->rcap) {
+        // 1文字ずつ伸びても作り直しが償却O(1)回になるよう倍々で広げる
+        int rcap = r->rcap * 2 > rsize + 1 ? r->rcap * 2 : rsize + 1;
+        rcap = editorSlabSize(2 * rcap) / 2;
+        char *render = editorSlabAlloc(2 * rcap);
+        memcpy(render, r->render, r->rsize + 1);
+        memcpy(render + rcap, r->hl, r->rsize);
+        editorSlabFree(r->render, 2 * r->rcap);
+        r->render = render;
+        r->hl = (unsigned char *)render + rcap;
+        r->rcap = rcap;
+    }
+    memmove(&r->render[newrx], &r->render[oldrx], r->rsize - oldrx + 1);
+    memmove(&r->hl[newrx], &r->hl[oldrx], r->rsize - oldrx);
+    r->rsize = rsize;
+
+    // 編集した所から次のタブまでを作り直す
+    int idx = rx;
+    int k;
+    for (k = at; k < j; k++) {
+        if (row->chars[k] == '\t') {
+            r->render[idx++] = ' ';
+            while (idx % KILO_TAB_STOP != 0) r->render[idx++] = ' ';
+        } else {
+            r->render[idx++] = row->chars[k];
+        }
+    }
+
+    // ハイライトは文字列やコメントの状態が後ろに続くので、前と同じ状態に戻る所まで付け直す
+    // charsのj文字目以降はhlも編集前のものをずらしてある
+    if (E.syntax)
+        editorUpdateSyntaxFrom(row, at, j);
+    else
+        memset(&r->hl[rx], HL_NORMAL, newrx - rx);
+}
+
+// charsをそのまま行として登録する (コピーしない)
+// charsはeditorSlabAlloc(len + 1)で確保した領域か、ROW_MAPPEDの場合はmmap領域を指す
+void editorInsertRowChars(int at, char *chars, size_t len, int flags) {
+    if (at < 0 || at > E.numrows)
+        return;
+
+    erow *row = editorAllocRow();
+    row->size = len;
+    row->cap = (flags & ROW_MAPPED) ? 0 : editorSlabSize(len + 1);
+    row->chars = chars;
+    row->flags = flags | ROW_HL_STALE;
+    row->savegen = E.savegen;
+    row->hl_in = 0;
+    row->hl_oc = 0;
+
+    row->r = NULL;
+
+    editorRowGapReserve(1);
+    editorRowGapMove(at);
+    E.row[E.gap++] = row;
+
+    E.numrows++;
+    E.dirty++;
+}
+
+void editorInsertRow(int at, char *s, size_t len) {
+    if (at < 0 || at > E.numrows)
+        return;
+
+    char *chars = editorSlabAlloc(len + 1); // 1バイトはnull文字
+    memcpy(chars, s, len);
+    chars[len] = '\0';
+    editorInsertRowChars(at, chars, len, 0);
+}
+
+// 行のcharsが実行中の保存のスナップショットから参照されているか
+int editorRowFrozen(erow *row) {
+    return E.save != NULL && row->savegen < E.save->gen;
+}
+
+// スナップショットから参照されているcharsは保存が終わってから解放する
+void editorSaveDeferFree(char *chars, int cap) {
+    struct saveJob *job = E.save;
+    if (job->ngarbage == job->garbagecap) {
+        job->garbagecap = job->garbagecap ? job->garbagecap * 2 : 64;
+        job->garbage = realloc(job->garbage, sizeof(struct iovec) * job->garbagecap);
+        if (job->garbage == NULL) die("realloc");
+    }
+    job->garbage[job->ngarbage].iov_base = chars;
+    job->garbage[job->ngarbage].iov_len = cap;
+    job->ngarbage++;
+}
+
+// 行のcharsを手放す (mmap領域は解放せず、保存中のスナップショットにあれば後で解放する)
+void editorRowFreeChars(erow *row) {
+    if (row->flags & ROW_MAPPED)
+        return;
+    if (editorRowFrozen(row))
+        editorSaveDeferFree(row->chars, row->cap);
+    else
+        editorSlabFree(row->chars, row->cap);
+}
+
+void editorFreeRow(erow *row) {
+    editorRowDropRender(row);
+    editorRowFreeChars(row);
+}
+
+void editorDelRow(int at) {
+    if (at < 0 || at >= E.numrows)
+        return;
+    erow *row = editorRow(at);
+    editorFreeRow(row);
+    editorReleaseRow(row);
+
+    // ギャップの直後が削除する行になるので、ギャップを1つ広げれば消える
+    editorRowGapMove(at);
+    E.numrows--;
+    E.dirty++;
+}
+
+// 書き換えられない行を書き換える前に自前のバッファにコピーする (copy-on-write)
+// mmap領域を指している行: 未編集の行はファイルを指したままなので、開く時にコピーが発生しない
+// 保存中のスナップショットに含まれる行: 元のcharsは保存スレッドが読み終わるまで残しておく
+void editorRowOwnChars(erow *row) {
+    int frozen = editorRowFrozen(row);
+    if (!(row->flags & ROW_MAPPED) && !frozen)
+        return;
+    char *chars = editorSlabAlloc(row->size + 1);
+    memcpy(chars, row->chars, row->size);
+    chars[row->size] = '\0';
+    if (frozen && !(row->flags & ROW_MAPPED))
+        editorSaveDeferFree(row->chars, row->cap);
+    row->chars = chars;
+    row->cap = editorSlabSize(row->size + 1);
+    row->flags &= ~ROW_MAPPED;
+    row->savegen = E.savegen;
+    if (row->flags & ROW_RENDER_CHARS)
+        row->r->render = chars;
+}
+
+// 行の中身をまとめてcharsのlenバイトに置き換える
+// charsはeditorSlabAlloc(len + 1)で確保したNULL文字で終わる領域で、行が引き取る (コピーしない)
+void editorRowSetChars(erow *row, char *chars, int len) {
+    editorRowFreeChars(row);
+    row->chars = chars;
+    row->size = len;
+    row->cap = editorSlabSize(len + 1);
+    row->flags &= ~ROW_MAPPED;
+    row->savegen = E.savegen;
+    editorUpdateRow(row);
+}
+
+// charsにlen文字 + NULL文字が入るようにする
+// 足りない時は倍々で広げるので、1文字ずつ追加してもreallocは償却O(1)回で済む
+void editorRowReserve(erow *row, int len) {
+    editorRowOwnChars(row);
+    if (len + 1 <= row->cap)
+        return;
+    int cap = row->cap < 16 ? 16 : row->cap;
+    while (cap < len + 1)
+        cap *= 2;
+    row->chars = editorSlabRealloc(row->chars, row->cap, cap);
+    row->cap = editorSlabSize(cap);
+    if (row->flags & ROW_RENDER_CHARS)
+        row->r->render = row->chars;
+}
+
+// ここの *rowは配列ではなく構造体へのポインタ
+void editorRowInsertChar(erow *row, int at, int c) {
+    if (at < 0 || at > row->size)
+        at = row->size;
+    editorRowReserve(row, row->size + 1);
+    // memmoveを使って文字列に文字を挿入する、memcpyだとoverlapしているので問題になるのでmemmoveを使う
+    memmove(&row->chars[at + 1], &row->chars[at], row->size - at + 1);
+    row->size++;
+    row->chars[at] = c;
+    editorUpdateRowFrom(row, at, 1, 0, 0);
+    E.dirty++;
+}
+
+// chars[at]にlenバイトの文字列を挿入する
+void editorRowInsertString(erow *row, int at, const char *s, size_t len) {
+    if (at < 0 || at > row->size)
+        at = row->size;
+    editorRowReserve(row, row->size + len);
+    memmove(&row->chars[at + len], &row->chars[at], row->size - at + 1);
+    memcpy(&row->chars[at], s, len);
+    row->size += len;
+    editorUpdateRowFrom(row, at, len, 0, 0);
+    E.dirty++;
+}
+
+void editorRowAppendString(erow *row, char *s, size_t len) {
+    editorRowInsertString(row, row->size, s, len);
+}
+
+// chars[at]からlenバイトを削除する
+void editorRowDelString(erow *row, int at, int len) {
+    if (at < 0 || len <= 0 || at + len > row->size)
+        return;
+    editorRowOwnChars(row);
+    int tab = memchr(&row->chars[at], '\t', len) != NULL;
+    memmove(&row->chars[at], &row->chars[at + len], row->size - at - len + 1);
+    row->size -= len;
+    editorUpdateRowFrom(row, at, 0, len, tab);
+    E.dirty++;
+}
+
+void editorRowDelChar(erow *row, int at) {
+    if (at < 0 || at >= row->size)
+        return;
+    editorRowOwnChars(row);
+    char c = row->chars[at];
+    memmove(&row->chars[at], &row->chars[at + 1], row->size - at);
+    row->size--;
+    editorUpdateRowFrom(row, at, 0, 1, c == '\t');
+    E.dirty++;
+}
+
+// at文字目以降を削除する
+void editorRowTruncate(erow *row, int at) {
+    if (at < 0 || at >= row->size)
+        return;
+    editorRowOwnChars(row);
+    row->size = at;
+    row->chars[row->size] = '\0';
+    row->flags |= ROW_HL_STALE; // 前半のhlは変わらないが、行末の状態は変わりうる
+    if (row->r && !(row->flags & ROW_RENDER_CHARS) && !memchr(row->chars, '\t', at)) {
+        // 最後のタブを切り落としたのでcharsを指す形に戻す
+        editorBuildRender(row);
+    } else if (row->r) {
+        // 前半のrenderとhlは変わらないので切り詰めるだけでよい
+        row->r->rsize = editorRowCxToRx(row, at);
+        row->r->render[row->r->rsize] = '\0';
+    }
+    E.dirty++;
+}
+
+/*** editor operations ***/
+
+void editorInsertChar(int c) {
+    int row = E.cy, col = E.cx;
+    int newrow = E.cy == E.numrows;
+    if (newrow) {
+        // 最後の行の場合は空白を挿入
+        editorInsertRow(E.numrows, "", 0);
+    }
+    editorRowInsertChar(editorRow(E.cy), E.cx, c);
+    editorRowChanged(E.cy);
+    E.cx++;
+
+    char ch = c;
+    editorUndoInsert(row, col, newrow, &ch, 1);
+}
+
+void editorInsertNewLine() {
+    int cy = E.cy, cx = E.cx;
+    int newrow = E.cy == E.numrows;
+    if (E.cx == 0) {
+        // 行頭の場合空行をinsert
+        editorInsertRow(E.cy, "", 0);
+        editorRowsInserted(E.cy, 1);
+    } else {
+        erow *row = editorRow(E.cy);
+        // 現在のカーソル位置から右側を取り出し下の行に挿入する
+        editorInsertRow(E.cy + 1, &row->chars[E.cx], row->size - E.cx);
+
+        // カーソル位置の行を切り詰める
+        editorRowTruncate(row, E.cx);
+        editorRowChanged(E.cy);
+        editorRowsInserted(E.cy + 1, 1);
+    }
+    E.cy++;
+    E.cx = 0;
+
+    // 行が無い所での改行は行を1つ作るだけ (改行を挿入すると2行になってしまう)
+    if (newrow)
+        editorUndoInsert(cy, cx, 1, "", 0);
+    else
+        editorUndoInsert(cy, cx, 0, "\n", 1);
+}
+
+// 次の改行 (\r か \n) の位置を返す。無ければend
+const char *editorFindEol(const char *p, const char *end) {
+    while (p < end && *p != '\r' && *p != '\n')
+        p++;
+    return p;
+}
+
+// 改行 (\r\n, \r, \n) の次の位置を返す
+const char *editorSkipEol(const char *p, const char *end) {
+    if (*p == '\r' && p + 1 < end && p[1] == '\n')
+        return p + 2;
+    return p + 1;
+}
+
+// 文字列をカーソル位置に挿入する (貼り付け用)
+// 1文字ずつeditorInsertChar/editorInsertNewLineするのではなく、改行で区切って行をまとめて作る
+void editorInsertText(const char *s, size_t len) {
+    if (len == 0)
+        return;
+    if (E.cy == E.numrows)
+        editorInsertRow(E.numrows, "", 0);
+
+    erow *row = editorRow(E.cy);
+    const char *end = s + len;
+    const char *eol = editorFindEol(s, end);
+    if (eol == end) {
+        // 改行を含まない場合は今の行に挿入するだけ
+        editorRowInsertString(row, E.cx, s, len);
+        editorRowChanged(E.cy);
+        E.cx += len;
+        return;
+    }
+
+    // カーソルより右側は貼り付けた最後の行の後ろに付ける
+    // 最後の行は今の行を切り詰める前に作っておき、右側を今の行から直接コピーする
+    const char *last = end;
+    while (last[-1] != '\r' && last[-1] != '\n')
+        last--;
+    size_t lastlen = end - last;
+    size_t taillen = row->size - E.cx;
+    char *chars = editorSlabAlloc(lastlen + taillen + 1);
+    memcpy(chars, last, lastlen);
+    memcpy(&chars[lastlen], &row->chars[E.cx], taillen);
+    chars[lastlen + taillen] = '\0';
+    editorRowTruncate(row, E.cx);
+    editorRowInsertString(row, E.cx, s, eol - s);
+
+    int at = E.cy + 1;
+    s = editorSkipEol(eol, end);
+    while (s < last) {
+        eol = editorFindEol(s, end);
+        editorInsertRow(at++, (char *)s, eol - s);
+        s = editorSkipEol(eol, end);
+    }
+    editorInsertRowChars(at, chars, lastlen + taillen, 0);
+    editorRowChanged(E.cy);
+    editorRowsInserted(E.cy + 1, at - E.cy);
+
+    E.cy = at;
+    E.cx = lastlen;
+}
+
+void editorDelChar() {
+    if (E.cy == E.numrows) // 末尾の場合は行がまだないのでスキップ
+        return;
+    if (E.cx == 0 && E.cy == 0) // 一番上の場合は上の行がないのでスキップ
+        return;
+
+    erow *row = editorRow(E.cy);
+    int bx = E.cx, by = E.cy;
+    if (E.cx > 0) {
+        // カーソル位置の左の文字を消すので-1している
+        char c = row->chars[E.cx - 1];
+        editorRowDelChar(row, E.cx - 1);
+        editorRowChanged(E.cy);
+        E.cx--;
+        editorUndoDelete(E.cy, E.cx, E.cy, E.cx + 1, &c, 1, bx, by);
+    } else {
+        // 行頭の場合は上の行にコピーしつつ行を削除
+        E.cx = editorRow(E.cy - 1)->size; // 上の行の末尾に移動
+        editorRowAppendString(editorRow(E.cy - 1), row->chars, row->size); // 上の行の末尾に今の行をコピー
+        editorDelRow(E.cy);
+        editorRowChanged(E.cy - 1);
+        editorRowsDeleted(E.cy, 1);
+        E.cy--;
+        editorUndoDelete(E.cy, E.cx, E.cy + 1, 0, "\n", 1, bx, by);
+    }
+}
+
+// (row, col)から(endrow, endcol)の手前までを削除する (途中の改行も消して1行にする)
+void editorDeleteRange(int row, int col, int endrow, int endcol) {
+    erow *first = editorRow(row);
+    if (row == endrow) {
+        editorRowDelString(first, col, endcol - col);
+        editorRowChanged(row);
+        return;
+    }
+    erow *last = editorRow(endrow);
+    editorRowTruncate(first, col);
+    editorRowAppendString(first, &last->chars[endcol], last->size - endcol);
+    // 削除する行はギャップのすぐ後ろに並ぶので、1行ずつ消してもO(行数)
+    int j;
+    for (j = row + 1; j <= endrow; j++)
+        editorDelRow(row + 1);
+    editorRowChanged(row);
+    editorRowsDeleted(row + 1, endrow - row);
+}
+
+/*** undo ***/
+
+// 記録の文字列用にlenバイト取る。今のかたまりに入らなければ新しいかたまりを足す
+char *editorUndoAlloc(size_t len, struct undoChunk **chunk) {
+    struct undoChunk *c = E.undo.arena;
+    if (c == NULL || c->cap - c->used < len) {
+        size_t cap = len > KILO_UNDO_CHUNK ? len : KILO_UNDO_CHUNK;
+        c = malloc(sizeof(struct undoChunk) + cap);
+        if (c == NULL) die("malloc");
+        c->prev = E.undo.arena;
+        c->used = 0;
+        c->cap = cap;
+        E.undo.arena = c;
+    }
+    char *p = &c->data[c->used];
+    c->used += len;
+    *chunk = c;
+    return p;
+}
+
+// 取り消した後に新しく編集したら、やり直しの記録 rec[cur, n) を捨てる
+void editorUndoDiscardRedo() {
+    struct editorUndo *u = &E.undo;
+    if (u->cur == u->n)
+        return;
+    struct undoRecord *r = &u->rec[u->cur];
+    while (u->arena != r->chunk) {
+        struct undoChunk *prev = u->arena->prev;
+        free(u->arena);
+        u->arena = prev;
+    }
+    r->chunk->used = r->text - r->chunk->data;
+    u->n = u->cur;
+}
+
+// 記録を追加する。カーソル位置は今の位置、範囲の終わりは(row, col)にしておくので呼び出し側で直す
+struct undoRecord *editorUndoPush(int type, int flags, int row, int col, const char *text, size_t len) {
+    struct editorUndo *u = &E.undo;
+    editorUndoDiscardRedo();
+    if (u->n == u->cap) {
+        u->cap = u->cap ? u->cap * 2 : 64;
+        u->rec = realloc(u->rec, sizeof(struct undoRecord) * u->cap);
+        if (u->rec == NULL) die("realloc");
+    }
+    struct undoRecord *r = &u->rec[u->n++];
+    u->cur = u->n;
+    r->type = type;
+    r->flags = flags;
+    r->row = r->endrow = row;
+    r->col = r->endcol = col;
+    r->bx = r->ax = E.cx;
+    r->by = r->ay = E.cy;
+    r->text = editorUndoAlloc(len, &r->chunk);
+    if (len)
+        memcpy(r->text, text, len);
+    r->len = len;
+    return r;
+}
+
+// 記録の文字列を逆順にする (UNDO_REVERSEDを切り替える)
+void editorUndoReverse(struct undoRecord *r) {
+    size_t i;
+    for (i = 0; i < r->len / 2; i++) {
+        char c = r->text[i];
+        r->text[i] = r->text[r->len - 1 - i];
+        r->text[r->len - 1 - i] = c;
+    }
+    r->flags ^= UNDO_REVERSED;
+}
+
+// 最後の記録に1文字足す (frontなら先頭に)
+// 記録の文字列は必ずかたまりの末尾にあるので、空きがあればその場で伸ばせる
+// 先頭に足す時は文字列を逆順で持ち、末尾に足すだけで済ませる (1文字ごとに全体をずらさない)
+void editorUndoExtend(struct undoRecord *r, char c, int front) {
+    if (front != ((r->flags & UNDO_REVERSED) != 0))
+        editorUndoReverse(r);
+    struct undoChunk *chunk = r->chunk;
+    if (chunk == E.undo.arena && chunk->used < chunk->cap) {
+        chunk->used++;
+    } else {
+        // 移した先でも続けて伸ばせるよう倍の大きさを取り、使っていない後ろ半分は空きに戻す
+        // (かたまりより長い記録が1文字ごとに移ってコピーされ続けないように)
+        char *text = editorUndoAlloc(2 * (r->len + 1), &chunk);
+        chunk->used -= r->len + 1;
+        memcpy(text, r->text, r->len);
+        r->chunk->used -= r->len;
+        r->text = text;
+        r->chunk = chunk;
+    }
+    r->text[r->len] = c;
+    r->len++;
+}
+
+// 続けて打った1文字の編集なら、最後の記録を返す (まとめられなければNULL)
+struct undoRecord *editorUndoLastTyping(int type, const char *text, size_t len) {
+    struct editorUndo *u = &E.undo;
+    if (len != 1 || text[0] == '\n' || u->cur == 0 || u->cur != u->n)
+        return NULL;
+    struct undoRecord *r = &u->rec[u->n - 1];
+    if (r->type != type || !(r->flags & UNDO_TYPING))
+        return NULL;
+    return r;
+}
+
+// 挿入を記録する (挿入した後に呼ぶ)。カーソルは(col, row)から今の位置に動いている
+// newrowは行が無い所に行を作ってから挿入した場合
+void editorUndoInsert(int row, int col, int newrow, const char *text, size_t len) {
+    struct undoRecord *r = editorUndoLastTyping(UNDO_INSERT, text, len);
+    if (r && !newrow && r->endrow == row && r->endcol == col) {
+        editorUndoExtend(r, text[0], 0);
+    } else {
+        int flags = (newrow ? UNDO_NEWROW : 0) |
+            (len == 1 && text[0] != '\n' ? UNDO_TYPING : 0);
+        r = editorUndoPush(UNDO_INSERT, flags, row, col, text, len);
+        r->bx = col;
+        r->by = row;
+    }
+    if (len) {
+        r->endrow = E.cy;
+        r->endcol = E.cx;
+    }
+    r->ax = E.cx;
+    r->ay = E.cy;
+    editorJournalOp(UNDO_INSERT, newrow ? UNDO_NEWROW : 0, row, col,
+        len ? E.cy : row, len ? E.cx : col, text, len);
+}
+
+// 削除を記録する (削除した後に呼ぶ)。(row, col)から(endrow, endcol)までのtextを削除し、
+// カーソルは(bx, by)から今の位置に動いた
+// 続けてBackspaceした分は先頭に、Deleteした分は末尾に足して1つにまとめる
+void editorUndoDelete(int row, int col, int endrow, int endcol, const char *text, size_t len,
+                      int bx, int by) {
+    struct undoRecord *r = editorUndoLastTyping(UNDO_DELETE, text, len);
+    if (r && r->row == row && r->col == col + 1) {
+        editorUndoExtend(r, text[0], 1);
+        r->row = row;
+        r->col = col;
+    } else if (r && r->row == row && r->col == col) {
+        editorUndoExtend(r, text[0], 0);
+        r->endcol++;
+    } else {
+        r = editorUndoPush(UNDO_DELETE, len == 1 && text[0] != '\n' ? UNDO_TYPING : 0,
+            row, col, text, len);
+        r->endrow = endrow;
+        r->endcol = endcol;
+        r->bx = bx;
+        r->by = by;
+    }
+    r->ax = E.cx;
+    r->ay = E.cy;
+    editorJournalOp(UNDO_DELETE, 0, row, col, endrow, endcol, text, len);
+}
+
+// 記録を取り消す (redoならやり直す)
+// 挿入の取り消しと削除のやり直しは範囲の削除、その逆は文字列の挿入になる
+// どちらも行をまとめて扱うので、大きな貼り付けでも文字列の長さに比例する時間で済む
+void editorUndoApply(struct undoRecord *r, int redo) {
+    if (r->flags & UNDO_REVERSED)
+        editorUndoReverse(r);
+    int insert = (r->type == UNDO_INSERT) == (redo != 0);
+    editorJournalOp(insert ? UNDO_INSERT : UNDO_DELETE, r->flags & UNDO_NEWROW,
+        r->row, r->col, r->endrow, r->endcol, r->text, r->len);
+    if (insert) {
+        E.cy = r->row;
+        E.cx = r->col;
+        if (E.cy == E.numrows) {
+            editorInsertRow(E.numrows, "", 0);
+            editorRowsInserted(E.cy, 1);
+        }
+        // 1行の中の編集は行の文字をそのまま戻す (文字として入力された\rや\nを改行にしない)
+        if (r->endrow == r->row) {
+            editorRowInsertString(editorRow(E.cy), E.cx, r->text, r->len);
+            editorRowChanged(E.cy);
+        } else {
+            editorInsertText(r->text, r->len);
+        }
+    } else {
+        editorDeleteRange(r->row, r->col, r->endrow, r->endcol);
+        if (r->flags & UNDO_NEWROW) {
+            editorDelRow(r->row);
+            editorRowsDeleted(r->row, 1);
+        }
+    }
+}
+
+// 取り消し・やり直しの後、カーソルが行の外に出ないようにする
+void editorUndoMoveCursor(int cx, int cy) {
+    E.cy = cy > E.numrows ? E.numrows : cy;
+    int rowlen = E.cy < E.numrows ? editorRow(E.cy)->size : 0;
+    E.cx = cx > rowlen ? rowlen : cx;
+}
+
+void editorUndo() {
+    struct editorUndo *u = &E.undo;
+    if (u->cur == 0) {
+        editorSetStatusMessage("Nothing to undo");
+        return;
+    }
+    struct undoRecord *r;
+    do {
+        r = &u->rec[--u->cur];
+        editorUndoApply(r, 0);
+    } while ((r->flags & UNDO_CHAIN) && u->cur > 0);
+    editorUndoMoveCursor(r->bx, r->by);
+}
+
+void editorRedo() {
+    struct editorUndo *u = &E.undo;
+    if (u->cur == u->n) {
+        editorSetStatusMessage("Nothing to redo");
+        return;
+    }
+    struct undoRecord *r;
+    do {
+        r = &u->rec[u->cur++];
+        editorUndoApply(r, 1);
+    } while (u->cur < u->n && (u->rec[u->cur].flags & UNDO_CHAIN));
+    editorUndoMoveCursor(r->ax, r->ay);
+}
+
+/*** file i/o ***/
+
+// ファイル名からハイライトの種類を決める
+void editorSelectSyntaxHighlight() {
+    struct editorSyntax *old = E.syntax;
+    E.syntax = NULL;
+    if (E.filename != NULL) {
+        char *ext = strrchr(E.filename, '.');
+        unsigned int j;
+        for (j = 0; j < HLDB_ENTRIES && E.syntax == NULL; j++) {
+            struct editorSyntax *s = &HLDB[j];
+            int i;
+            for (i = 0; s->filematch[i]; i++) {
+                int is_ext = (s->filematch[i][0] == '.');
+                if ((is_ext && ext && !strcmp(ext, s->filematch[i])) ||
+                    (!is_ext && strstr(E.filename, s->filematch[i]))) {
+                    E.syntax = s;
+                    break;
+                }
+            }
+        }
+    }
+    if (E.syntax == old)
+        return;
+    if (E.syntax && E.syntax->kwtab == NULL)
+        editorSyntaxKeywords(E.syntax);
+
+    // 種類が変わったら全部の行のハイライトを作り直す
+    int j;
+    for (j = 0; j < E.numrows; j++)
+        editorUpdateRow(editorRow(j));
+    E.hl_frontier = 0;
+}
+
+// 処理をn個以下に分けられる時に使うスレッド数 (CPU数とKILO_THREADSまで、最低1)
+int editorThreadCount(size_t n) {
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    if (n > (size_t)ncpu)
+        n = ncpu;
+    if (n > KILO_THREADS)
+        n = KILO_THREADS;
+    return n < 1 ? 1 : n;
+}
+
+// ファイルの一部分 [start, end) の改行の位置
+struct openChunk {
+    pthread_t thread;
+    const char *start;
+    const char *end;
+    size_t *nl;  // 改行のstartからの位置
+    size_t nnl;
+    size_t nlcap;
+};
+
+// チャンクの中の改行を全部探してnlに記録する (スレッドで実行する)
+void *editorIndexChunk(void *arg) {
+    struct openChunk *c = arg;
+    const char *p = c->start;
+    const char *nl;
+    while ((nl = memchr(p, '\n', c->end - p)) != NULL) {
+        if (c->nnl == c->nlcap) {
+            c->nlcap = c->nlcap ? c->nlcap * 2 : 1024;
+            c->nl = realloc(c->nl, sizeof(size_t) * c->nlcap);
+            if (c->nl == NULL) die("realloc");
+        }
+        c->nl[c->nnl++] = nl - c->start;
+        p = nl + 1;
+    }
+    return NULL;
+}
+
+// mmapしたファイルが他のプロセスに切り詰められると (logrotateのcopytruncateなど)、
+// ファイルの外になったページを読んだ所でSIGBUSが来る。そのままだと落ちて未保存の編集が失われるので、
+// そのページから後ろを0のページに差し替えて読み直せるようにし、後でeditorMapCheckで行をコピーする
+void handleSIGBUS(int sig, siginfo_t *si, void *unused __attribute__((unused))) {
+    char *addr = si->si_addr;
+    if (E.map == NULL || addr < E.map || addr >= E.map + E.maplen) {
+        // mmapと関係ないSIGBUSは戻った所でもう一度起こして普通に落とす
+        signal(sig, SIG_DFL);
+        return;
+    }
+    size_t cut = (addr - E.map) / E.mappage * E.mappage;
+    if (mmap(E.map + cut, E.maplen - cut, PROT_READ,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) == MAP_FAILED) {
+        signal(sig, SIG_DFL);
+        return;
+    }
+    if (cut < E.mapcut)
+        E.mapcut = cut;
+    E.maptruncated = 1;
+}
+
+// mmapを指している行を全部自前のバッファにコピーする
+// 0のページに差し替えた所にかかっていた (中身が失われた) 行数を返す
+int editorMapOwnRows() {
+    if (E.map == NULL)
+        return 0;
+    int lost = 0;
+    int j;
+    for (j = 0; j < E.numrows; j++) {
+        erow *row = editorRow(j);
+        if (!(row->flags & ROW_MAPPED))
+            continue;
+        if (row->chars + row->size > E.map + E.mapcut)
+            lost++;
+        editorRowOwnChars(row);
+    }
+    return lost;
+}
+
+// SIGBUSでmmapの後ろを差し替えていたら、mmapを指している行を全部自前のバッファにコピーする
+// 切り詰められたファイルには後から別の内容が書かれることがあり (MAP_PRIVATEでも
+// 書き換えていないページにはファイルの変更が見える)、まだ読める所も当てにならないため
+// 差し替えた所より後ろの行の中身は失われて0になっている
+void editorMapCheck() {
+    if (!E.maptruncated)
+        return;
+    E.maptruncated = 0;
+    int lost = editorMapOwnRows();
+    editorSetStatusMessage("Warning: file was truncated on disk, %d unedited lines could not be read", lost);
+}
+
+// mmapしたファイルを改行で区切って行を作る
+// 各行のcharsはファイルを直接指すので、行の中身のコピーは発生しない
+// 大きなファイルは分割して複数のスレッドで改行を探し、全部の位置が揃ってから行を作る
+void editorOpenMapped(char *map, size_t len) {
+    E.map = map;
+    E.maplen = len;
+    E.mappage = sysconf(_SC_PAGESIZE);
+    E.mapcut = len;
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_sigaction = handleSIGBUS;
+    sa.sa_flags = SA_SIGINFO;
+    sigemptyset(&sa.sa_mask);
+    if (sigaction(SIGBUS, &sa, NULL) == -1) die("sigaction");
+
+    size_t nchunks = editorThreadCount(len / KILO_OPEN_CHUNK);
+    struct openChunk chunks[KILO_THREADS];
+    size_t i;
+    for (i = 0; i < nchunks; i++) {
+        chunks[i].start = map + len / nchunks * i;
+        chunks[i].end = i == nchunks - 1 ? map + len : map + len / nchunks * (i + 1);
+        chunks[i].nl = NULL;
+        chunks[i].nnl = 0;
+        chunks[i].nlcap = 0;
+    }
+    // 1つ目のチャンクはこのスレッドで探す。スレッドを作れなかったチャンクも同じ
+    int started[KILO_THREADS] = { 0 };
+    for (i = 1; i < nchunks; i++)
+        started[i] = pthread_create(&chunks[i].thread, NULL, editorIndexChunk, &chunks[i]) == 0;
+    editorIndexChunk(&chunks[0]);
+    size_t total = chunks[0].nnl;
+    for (i = 1; i < nchunks; i++) {
+        if (started[i])
+            pthread_join(chunks[i].thread, NULL);
+        else
+            editorIndexChunk(&chunks[i]);
+        total += chunks[i].nnl;
+    }
+
+    editorRowGapReserve(total + 1);
+    char *p = map;
+    for (i = 0; i < nchunks; i++) {
+        size_t j;
+        for (j = 0; j < chunks[i].nnl; j++) {
+            char *nl = (char *)chunks[i].start + chunks[i].nl[j];
+            size_t linelen = nl - p;
+            while (linelen > 0 && p[linelen - 1] == '\r')
+                linelen--;
+            editorInsertRowChars(E.numrows, p, linelen, ROW_MAPPED);
+            p = nl + 1;
+        }
+        free(chunks[i].nl);
+    }
+    // 最後の行が改行で終わっていない場合
+    if (p < map + len) {
+        size_t linelen = map + len - p;
+        while (linelen > 0 && p[linelen - 1] == '\r')
+            linelen--;
+        editorInsertRowChars(E.numrows, p, linelen, ROW_MAPPED);
+    }
+}
+
+void editorOpen(char *filename) {
+    // これ必要か？
+    free(E.filename);
+    E.filename = strdup(filename);
+    editorSelectSyntaxHighlight();
+    FILE *fp = fopen(filename, "r");
+    if (!fp) die("fopen");
+
+    // 通常のファイルはmmapして開く (getlineで1行ずつコピーしない)
+    struct stat st;
+    if (fstat(fileno(fp), &st) != -1 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(fp), 0);
+        if (map != MAP_FAILED) {
+            editorOpenMapped(map, st.st_size);
+            fclose(fp);
+            E.dirty = 0;
+            return;
+        }
+    }
+
+    // mmapできない場合 (パイプなど) はgetlineで読み込む
+    char *line = NULL;
+    size_t linecap = 0;
+    ssize_t linelen;
+    while ((linelen = getline(&line, &linecap, fp)) != -1) {
+        while (linelen > 0 && (line[linelen - 1] == '\n' ||
+                            line[linelen - 1] == '\r')) {
+            // 改行文字がlinelenに入っているので、改行があった場合に文字数をその分減らす
+            // abc\r\n\0 (linelen = 5) -> linelen = 3になる
+            linelen--;
+        }
+        editorInsertRow(E.numrows, line, linelen);
+    }
+    // MEMO: EOFとエラーを区別したいときはferror(3)かfeof(3)を使うらしい
+    if (ferror(fp))
+        die("Unable to read line from file");
+    free(line);
+    fclose(fp);
+    E.dirty = 0;
+}
+
+// writevでiovを全部書き込む (途中までしか書けなかった場合は残りを書き直す)
+int editorWritevAll(int fd, struct iovec *iov, int cnt) {
+    while (cnt > 0) {
+        ssize_t n = writev(fd, iov, cnt);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        while (cnt > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            cnt--;
+        }
+        if (cnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return 0;
+}
+
+// 保存スレッドからメインスレッドに通知を送る
+// 途中経過は読まれていなくても構わないので、パイプが詰まっていたら捨てる
+void editorSaveNotify(struct saveJob *job, int done, int err, long long bytes) {
+    struct saveEvent ev = { done, err, bytes };
+    if (done) {
+        int flags = fcntl(job->pipefd[1], F_GETFL);
+        fcntl(job->pipefd[1], F_SETFL, flags & ~O_NONBLOCK);
+    }
+    while (write(job->pipefd[1], &ev, sizeof(ev)) == -1 && errno == EINTR)
+        ;
+}
+
+// スナップショットの行を一時ファイルに書き、元のファイルにrenameで置き換える
+// 行全体を1つのバッファにまとめずcharsからwritevでまとめて書くので、余分なメモリは一定で済む
+// 途中で失敗しても元のファイルは書き換わらない。書いたバイト数を返す (失敗したら-1)
+// 保存スレッドで実行する
+// 保存先を開く。普通は同じディレクトリに作った一時ファイルに書いてからrenameで置き換える
+// (書いている途中で落ちても元のファイルは壊れない)。renameするとinodeが変わるので、
+// 次の場合は元のファイルに直接書く
+// - ハードリンクがある (renameすると他の名前の方は古い中身のまま残る)
+// - ディレクトリに書き込めず一時ファイルを作れない
+// - 一時ファイルの持ち主とグループを元のファイルに合わせられない (他人のファイルなど)
+// 開けなければ-1を返す
+// pathを一時ファイルからのrenameで置き換えられるか
+// stickyビットの付いたディレクトリ (/tmpなど) では、他人のファイルはrenameで置き換えられない
+int editorSaveCanReplace(const char *path, const struct stat *st) {
+    if (geteuid() == 0 || st->st_uid == geteuid())
+        return 1;
+    char *dir = strdup(path);
+    if (dir == NULL) die("strdup");
+    char *slash = strrchr(dir, '/');
+    if (slash) *slash = '\0';
+    struct stat dst;
+    int ok = stat(slash ? (dir[0] ? dir : "/") : ".", &dst) == -1 ||
+        !(dst.st_mode & S_ISVTX) || dst.st_uid == geteuid();
+    free(dir);
+    return ok;
+}
+
+int editorSaveOpen(struct saveJob *job) {
+    // シンボリックリンクの場合はリンク先を置き換える
+    job->path = realpath(job->filename, NULL);
+    if (job->path == NULL) {
+        if (errno != ENOENT) return -1;
+        job->path = strdup(job->filename); // 新しいファイル
+    }
+
+    struct stat st;
+    int exists = stat(job->path, &st) == 0;
+    job->fd = -1;
+    if (!exists || (st.st_nlink == 1 && editorSaveCanReplace(job->path, &st))) {
+        job->tmp = malloc(strlen(job->path) + 16);
+        if (job->tmp == NULL) die("malloc");
+        sprintf(job->tmp, "%s.kilo-XXXXXX", job->path); // renameできるよう同じディレクトリに作る
+        job->fd = mkstemp(job->tmp);
+        // パーミッションと持ち主は元のファイルに合わせる (新しいファイルなら0644)
+        // fchownはsetuidビットを落とすので、fchmodはその後にする
+        mode_t mode = exists ? st.st_mode & 07777 : 0644 & ~job->mask;
+        if (job->fd != -1 && exists && fchown(job->fd, st.st_uid, st.st_gid) == -1) {
+            // 他人のファイルや入っていないグループのファイルでは持ち主を変えられない
+            // 直接書くと途中で落ちた時にファイルが壊れるので、持ち主は自分になるがrenameで置き換える
+            // (グループだけは合わせられることがある。setuid/setgidビットは自分のファイルには付けない)
+            if (fchown(job->fd, -1, st.st_gid) == -1)
+                mode &= ~S_ISGID;
+            mode &= ~S_ISUID;
+            job->note = " (owner not kept)";
+        }
+        if (job->fd != -1 && fchmod(job->fd, mode) == -1) {
+            close(job->fd);
+            unlink(job->tmp);
+            job->fd = -1;
+        }
+        if (job->fd == -1) {
+            free(job->tmp);
+            job->tmp = NULL;
+        }
+    }
+    if (job->fd == -1) {
+        // 一時ファイルを作れない (ディレクトリに書けないなど) か置き換えられない時と、
+        // ハードリンクを保つ時は直接書く
+        job->fd = open(job->path, O_RDWR | O_CREAT, 0644);
+        if (job->fd == -1) return -1;
+        job->note = " (in place, not atomic)";
+    }
+    return 0;
+}
+
+// job->fdに行を書き込み、一時ファイルならjob->pathをそれで置き換える
+long long editorWriteFile(struct saveJob *job) {
+    char *path = job->path;
+    char *tmp = job->tmp;
+    int fd = job->fd;
+    job->fd = -1;
+
+    struct iovec iov[KILO_SAVE_IOV];
+    int cnt = 0;
+    long long total = 0;
+    long long notified = editorNowMs();
+    int j;
+    for (j = 0; j < job->numrows; j++) {
+        iov[cnt++] = job->rows[j];
+        iov[cnt].iov_base = "\n";
+        iov[cnt++].iov_len = 1;
+        total += job->rows[j].iov_len + 1;
+        if (cnt == KILO_SAVE_IOV || j == job->numrows - 1) {
+            if (editorWritevAll(fd, iov, cnt) == -1) goto fail;
+            cnt = 0;
+            // 途中経過は100ミリ秒ごとに知らせる
+            long long now = editorNowMs();
+            if (now - notified >= 100) {
+                editorSaveNotify(job, 0, 0, total);
+                notified = now;
+            }
+        }
+    }
+
+    // 直接書いている時は、書き終わってから余った後ろを切り詰める (空のファイルになる時間を作らない)
+    if (tmp == NULL && ftruncate(fd, total) == -1) goto fail;
+    if (KILO_SAVE_FSYNC >= 1 && fsync(fd) == -1) goto fail;
+    if (close(fd) == -1) {
+        fd = -1;
+        goto fail;
+    }
+    fd = -1;
+    if (tmp == NULL)
+        return total;
+    if (rename(tmp, path) == -1) goto fail;
+
+    if (KILO_SAVE_FSYNC >= 2) {
+        // renameしたことを確実にディスクに残すためディレクトリもfsyncする
+        char *slash = strrchr(path, '/');
+        if (slash) *slash = '\0';
+        int dfd = open(slash ? (path[0] ? path : "/") : ".", O_RDONLY);
+        if (dfd != -1) {
+            fsync(dfd);
+            close(dfd);
+        }
+    }
+    return total;
+
+fail:;
+    int saved_errno = errno;
+    if (fd != -1) close(fd);
+    if (tmp)
+        unlink(tmp);
+    errno = saved_errno;
+    return -1;
+}
+
+void *editorSaveThread(void *arg) {
+    struct saveJob *job = arg;
+    long long len = editorWriteFile(job);
+    editorSaveNotify(job, 1, len == -1 ? errno : 0, len);
+    return NULL;
+}
+
+// 保存スレッドからの通知を1つ読んでメッセージバーに出す。保存が終わっていたら後始末をする
+void editorSaveProcessEvent() {
+    struct saveJob *job = E.save;
+    struct saveEvent ev;
+    if (read(job->pipefd[0], &ev, sizeof(ev)) != sizeof(ev))
+        return;
+    if (!ev.done) {
+        editorSetStatusMessage("Saving... %lld%%", ev.bytes * 100 / job->total);
+        return;
+    }
+
+    pthread_join(job->thread, NULL);
+    if (ev.err == 0) {
+        // 保存を始めてからの編集は保存されていないので残す
+        E.dirty -= job->dirty;
+        editorJournalReset(job->filename);
+        editorSetStatusMessage("%lld bytes written to disk%s", ev.bytes, job->note ? job->note : "");
+    } else {
+        editorJournalMark(0);
+        editorSetStatusMessage("Can't save! I/O error: %s", strerror(ev.err));
+    }
+
+    int j;
+    for (j = 0; j < job->ngarbage; j++)
+        editorSlabFree(job->garbage[j].iov_base, job->garbage[j].iov_len);
+    free(job->garbage);
+    free(job->rows);
+    free(job->filename);
+    free(job->path);
+    free(job->tmp);
+    close(job->pipefd[0]);
+    close(job->pipefd[1]);
+    free(job);
+    E.save = NULL;
+}
+
+// 実行中の保存が終わるまで待つ
+void editorSaveWait() {
+    while (E.save) {
+        struct pollfd pfd = { E.save->pipefd[0], POLLIN, 0 };
+        if (poll(&pfd, 1, -1) > 0)
+            editorSaveProcessEvent();
+    }
+}
+
+// 行のスナップショットを作り、保存スレッドに書き込ませる
+// スナップショットは行のcharsを指すだけでコピーしない。保存中に編集された行は
+// editorRowOwnCharsでコピーしてから書き換えるので、保存スレッドからは保存を始めた時の中身が見える
+void editorSave() {
+    if (E.save) {
+        editorSetStatusMessage("Save already in progress");
+        return;
+    }
+    if (E.filename == NULL) {
+        E.filename = editorPrompt("Save as: %s (ESC to cancel)", NULL);
+        if (E.filename == NULL) {
+            editorSetStatusMessage("Save aborted");
+            return;
+        }
+        editorSelectSyntaxHighlight();
+    }
+
+    struct saveJob *job = calloc(1, sizeof(struct saveJob));
+    if (job == NULL) die("calloc");
+    if (pipe(job->pipefd) == -1) die("pipe");
+    fcntl(job->pipefd[1], F_SETFL, O_NONBLOCK);
+    job->filename = strdup(E.filename);
+    job->mask = umask(0);
+    umask(job->mask);
+    if (editorSaveOpen(job) == -1) {
+        editorSetStatusMessage("Can't save! I/O error: %s", strerror(errno));
+        free(job->filename);
+        free(job->path);
+        close(job->pipefd[0]);
+        close(job->pipefd[1]);
+        free(job);
+        return;
+    }
+    // 元のファイルに直接書く時は、mmapしたファイルを書き換えながらそこから読むことになるので、
+    // mmapを指している行を先にコピーしておく (切り詰めたりずらして書いたりすると中身が壊れる)
+    if (job->tmp == NULL)
+        editorMapOwnRows();
+    job->rows = malloc(sizeof(struct iovec) * (E.numrows + 1));
+    if (job->rows == NULL) die("malloc");
+    job->numrows = E.numrows;
+    job->total = 1; // 0で割らないように
+    int j;
+    for (j = 0; j < E.numrows; j++) {
+        erow *row = editorRow(j);
+        job->rows[j].iov_base = row->chars;
+        job->rows[j].iov_len = row->size;
+        job->total += row->size + 1;
+    }
+    job->dirty = E.dirty;
+    job->gen = ++E.savegen;
+
+    // renameで置き換える時は、mmapしている元のファイルの中身は変わらない
+    E.save = job;
+    editorJournalMark(1);
+    if (pthread_create(&job->thread, NULL, editorSaveThread, job) != 0) {
+        // スレッドを作れない時はその場で保存する
+        editorSaveThread(job);
+        editorSaveWait();
+        return;
+    }
+    editorSetStatusMessage("Saving...");
+}
+
+/*** journal ***/
+
+// 保存していない編集をクラッシュや切断で失わないよう、編集操作を追記していくファイル
+// 先頭にstruct journalHeader、その後に編集1回ごと (取り消し・やり直しも1回の編集) に
+// struct journalRecordと文字列が続く。次に同じファイルを開いた時、ファイルが
+// ヘッダーの識別情報のままなら記録を順に適用して編集を復元できる
+// 保存が終わったら、保存した後の編集だけを残して作り直す。Ctrl-Qで終了する時は消す
+#define KILO_JOURNAL_MAGIC "KILOJNL1"
+
+// ファイル名に対応するジャーナルのパス (同じディレクトリの .ファイル名.kilo-journal)
+char *editorJournalPath(const char *filename) {
+    const char *base = strrchr(filename, '/');
+    int dirlen = base ? base - filename + 1 : 0;
+    base = base ? base + 1 : filename;
+    size_t len = dirlen + strlen(base) + sizeof(".kilo-journal") + 1;
+    char *path = malloc(len);
+    if (path == NULL) die("malloc");
+    snprintf(path, len, "%.*s.%s.kilo-journal", dirlen, filename, base);
+    return path;
+}
+
+// ファイルの今の識別情報 (無ければsizeが-1)
+void editorJournalIdentity(const char *filename, struct journalHeader *h) {
+    struct stat st;
+    memset(h, 0, sizeof(*h));
+    memcpy(h->magic, KILO_JOURNAL_MAGIC, sizeof(h->magic));
+    h->size = -1;
+    if (stat(filename, &st) == -1)
+        return;
+    h->dev = st.st_dev;
+    h->ino = st.st_ino;
+    h->size = st.st_size;
+    h->mtime_sec = st.st_mtim.tv_sec;
+    h->mtime_nsec = st.st_mtim.tv_nsec;
+}
+
+unsigned int editorJournalSum(const struct journalRecord *rec, const char *text, size_t len) {
+    struct journalRecord r = *rec;
+    r.sum = 0;
+    unsigned int h = 2166136261u;
+    size_t i;
+    for (i = 0; i < sizeof(r); i++)
+        h = (h ^ ((unsigned char *)&r)[i]) * 16777619u;
+    for (i = 0; i < len; i++)
+        h = (h ^ (unsigned char)text[i]) * 16777619u;
+    return h;
+}
+
+void editorJournalAppend(char **buf, size_t *len, size_t *cap, const void *s, size_t n) {
+    if (*len + n > *cap) {
+        size_t newcap = *cap ? *cap : 4096;
+        while (newcap < *len + n)
+            newcap *= 2;
+        *buf = realloc(*buf, newcap);
+        if (*buf == NULL) die("realloc");
+        *cap = newcap;
+    }
+    memcpy(*buf + *len, s, n);
+    *len += n;
+}
+
+// ヘッダーとtailだけのジャーナルを一時ファイルに作ってからpathに置き換え、書き込み用のfdを返す
+int editorJournalCreate(const char *path, const struct journalHeader *h,
+                        const char *tail, size_t taillen) {
+    size_t len = strlen(path) + sizeof(".tmp");
+    char *tmp = malloc(len);
+    if (tmp == NULL) die("malloc");
+    snprintf(tmp, len, "%s.tmp", path);
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd != -1) {
+        struct iovec iov[2] = {
+            { (void *)h, sizeof(*h) },
+            { (void *)tail, taillen },
+        };
+        if (editorWritevAll(fd, iov, 2) == -1 || fdatasync(fd) == -1 ||
+            rename(tmp, path) == -1) {
+            close(fd);
+            unlink(tmp);
+            fd = -1;
+        }
+    }
+    free(tmp);
+    return fd;
+}
+
+// 書き込みスレッド
+// 書いている間に溜まった記録は次の1回でまとめて書くので、編集が速くてもwriteとfdatasyncの回数は増えない
+void *editorJournalThread(void *arg) {
+    struct editorJournal *j = arg;
+    char *out = NULL;
+    size_t outcap = 0;
+
+    pthread_mutex_lock(&j->mutex);
+    for (;;) {
+        while (j->len == 0 && !j->reset)
+            pthread_cond_wait(&j->cond, &j->mutex);
+
+        // バッファを入れ替えて、書いている間もメインスレッドが追記できるようにする
+        char *w = j->buf;
+        size_t wlen = j->len;
+        size_t wcap = j->cap;
+        j->buf = out;
+        j->cap = outcap;
+        j->len = 0;
+        out = w;
+        outcap = wcap;
+
+        j->busy = 1;
+        int reset = j->reset;
+        char *path = j->resetpath;
+        struct journalHeader h = j->resethdr;
+        char *tail = j->tail;
+        size_t taillen = j->taillen;
+        if (reset) {
+            j->reset = 0;
+            j->resetpath = NULL;
+            j->marked = 0;
+            j->tail = NULL;
+            j->taillen = j->tailcap = 0;
+        }
+        pthread_mutex_unlock(&j->mutex);
+
+        if (wlen > 0 && j->fd != -1) {
+            struct iovec iov = { out, wlen };
+            if (editorWritevAll(j->fd, &iov, 1) == 0)
+                fdatasync(j->fd);
+        }
+        if (reset) {
+            int fd = editorJournalCreate(path, &h, tail, taillen);
+            free(tail);
+            if (j->fd != -1)
+                close(j->fd);
+            j->fd = fd;
+        }
+
+        pthread_mutex_lock(&j->mutex);
+        if (reset) {
+            if (j->path && strcmp(j->path, path) != 0)
+                unlink(j->path);
+            free(j->path);
+            j->path = path;
+        }
+        j->busy = 0;
+        pthread_cond_broadcast(&j->idle);
+    }
+    return NULL;
+}
+
+// 編集1回分を記録する。メインスレッドはバッファに追記して書き込みスレッドを起こすだけ
+void editorJournalOp(int type, int flags, int row, int col, int endrow, int endcol,
+                     const char *text, size_t len) {
+    struct editorJournal *j = E.journal;
+    if (j == NULL)
+        return;
+    struct journalRecord rec;
+    memset(&rec, 0, sizeof(rec));
+    rec.type = type;
+    rec.flags = flags;
+    rec.row = row;
+    rec.col = col;
+    rec.endrow = endrow;
+    rec.endcol = endcol;
+    rec.len = len;
+    rec.sum = editorJournalSum(&rec, text, len);
+
+    pthread_mutex_lock(&j->mutex);
+    editorJournalAppend(&j->buf, &j->len, &j->cap, &rec, sizeof(rec));
+    editorJournalAppend(&j->buf, &j->len, &j->cap, text, len);
+    if (j->marked) {
+        editorJournalAppend(&j->tail, &j->taillen, &j->tailcap, &rec, sizeof(rec));
+        editorJournalAppend(&j->tail, &j->taillen, &j->tailcap, text, len);
+    }
+    pthread_cond_signal(&j->cond);
+    pthread_mutex_unlock(&j->mutex);
+}
+
+// 保存を始めた時に1、失敗した時に0で呼ぶ。1の間の記録は保存後のジャーナルに残す
+void editorJournalMark(int marked) {
+    struct editorJournal *j = E.journal;
+    if (j == NULL)
+        return;
+    pthread_mutex_lock(&j->mutex);
+    j->marked = marked;
+    j->taillen = 0;
+    pthread_mutex_unlock(&j->mutex);
+}
+
+// 保存が終わったら、保存したファイルに対するジャーナルに作り直してもらう
+void editorJournalReset(const char *filename) {
+    struct editorJournal *j = E.journal;
+    if (j == NULL)
+        return;
+    pthread_mutex_lock(&j->mutex);
+    free(j->resetpath);
+    j->resetpath = editorJournalPath(filename);
+    editorJournalIdentity(filename, &j->resethdr);
+    j->reset = 1;
+    pthread_cond_signal(&j->cond);
+    pthread_mutex_unlock(&j->mutex);
+}
+
+// 終了する時に呼ぶ。保存していない編集は捨てるのでジャーナルも消す
+void editorJournalRemove() {
+    struct editorJournal *j = E.journal;
+    if (j == NULL)
+        return;
+    // 作り直している途中なら、作り終わってから消す
+    pthread_mutex_lock(&j->mutex);
+    while (j->busy || j->reset)
+        pthread_cond_wait(&j->idle, &j->mutex);
+    if (j->path)
+        unlink(j->path);
+    pthread_mutex_unlock(&j->mutex);
+}
+
+// ジャーナルの記録bufを順に適用する。記録が壊れているか、行の範囲に合わない所で止める
+// 適用できた所までのバイト数を返す
+size_t editorJournalReplay(const char *buf, size_t len) {
+    size_t off = 0;
+    while (len - off >= sizeof(struct journalRecord)) {
+        struct journalRecord rec;
+        memcpy(&rec, buf + off, sizeof(rec));
+        if (rec.len > len - off - sizeof(rec))
+            break;
+        const char *text = buf + off + sizeof(rec);
+        if (rec.sum != editorJournalSum(&rec, text, rec.len))
+            break;
+
+        // 位置が今の行に収まっているか
+        int rowlen = rec.row >= 0 && rec.row < E.numrows ? editorRow(rec.row)->size : 0;
+        if (rec.type > UNDO_DELETE || rec.row < 0 || rec.row > E.numrows ||
+            rec.col < 0 || rec.col > rowlen)
+            break;
+        if (rec.type == UNDO_DELETE) {
+            if (rec.endrow < rec.row || rec.endrow >= E.numrows ||
+                rec.endcol < 0 || rec.endcol > editorRow(rec.endrow)->size ||
+                (rec.endrow == rec.row && rec.endcol < rec.col))
+                break;
+        }
+
+        struct undoRecord r;
+        memset(&r, 0, sizeof(r));
+        r.type = rec.type;
+        r.flags = rec.flags & UNDO_NEWROW;
+        r.row = rec.row;
+        r.col = rec.col;
+        r.endrow = rec.endrow;
+        r.endcol = rec.endcol;
+        r.text = (char *)text;
+        r.len = rec.len;
+        editorUndoApply(&r, 1);
+        if (r.type == UNDO_INSERT)
+            editorUndoMoveCursor(r.endcol, r.endrow);
+        else
+            editorUndoMoveCursor(r.col, r.row);
+        off += sizeof(rec) + rec.len;
+    }
+    return off;
+}
+
+// ファイルを開いた後に呼ぶ。前回のジャーナルが残っていれば復元するか聞き、
+// 書き込みスレッドを起動してこれからの編集を記録し始める
+void editorJournalOpen() {
+    struct editorJournal *j = calloc(1, sizeof(struct editorJournal));
+    if (j == NULL) die("calloc");
+    j->fd = -1;
+    pthread_mutex_init(&j->mutex, NULL);
+    pthread_cond_init(&j->cond, NULL);
+    pthread_cond_init(&j->idle, NULL);
+
+    if (E.filename != NULL) {
+        struct journalHeader h;
+        editorJournalIdentity(E.filename, &h);
+        j->path = editorJournalPath(E.filename);
+
+        // 残っていたジャーナルを読む (ファイルが変わっていなければ使える)
+        char *old = NULL;
+        size_t oldlen = 0;
+        int fd = open(j->path, O_RDONLY);
+        if (fd != -1) {
+            struct stat st;
+            if (fstat(fd, &st) != -1 && (size_t)st.st_size > sizeof(h)) {
+                old = malloc(st.st_size);
+                if (old == NULL) die("malloc");
+                // readは途中までしか読まないことがあるので、最後まで (EOFまで) 読む
+                while (oldlen < (size_t)st.st_size) {
+                    ssize_t n = read(fd, old + oldlen, st.st_size - oldlen);
+                    if (n == -1 && errno == EINTR)
+                        continue;
+                    if (n == -1) {
+                        // 読めなかったジャーナルは上書きせずに残し、この編集は記録しない
+                        editorSetStatusMessage("Can't read journal %s: %s", j->path, strerror(errno));
+                        close(fd);
+                        free(old);
+                        free(j->path);
+                        free(j);
+                        return;
+                    }
+                    if (n == 0)
+                        break;
+                    oldlen += n;
+                }
+            }
+            close(fd);
+        }
+        size_t applied = 0;
+        if (oldlen > sizeof(h) && memcmp(old, &h, sizeof(h)) == 0) {
+            char *answer = editorPrompt("Unsaved changes found in journal. Recover? (y/n): %s", NULL);
+            if (answer && (answer[0] == 'y' || answer[0] == 'Y')) {
+                applied = editorJournalReplay(old + sizeof(h), oldlen - sizeof(h));
+                editorSetStatusMessage("Recovered %zu bytes of edits from journal", applied);
+            }
+            free(answer);
+        }
+
+        // 復元した所までを残して続きから書く (復元しなければ空のジャーナルにする)
+        j->fd = editorJournalCreate(j->path, &h, old ? old + sizeof(h) : NULL, applied);
+        free(old);
+    }
+
+    if (pthread_create(&j->thread, NULL, editorJournalThread, j) != 0) {
+        if (j->fd != -1)
+            close(j->fd);
+        free(j->path);
+        free(j);
+        return;
+    }
+    pthread_detach(j->thread);
+    E.journal = j;
+}
+
+/*** regex ***/
+
+// 正規表現は構文木からNFAを作り、NFAの状態の集合を必要になった分だけDFAの状態にする (lazy DFA)
+// バックトラックしないので、どんなパターンでも1文字あたりの処理は一定になる
+// 使える構文: 文字 . [...] [^...] \d \w \s (と大文字の否定) \エスケープ * + ? | ( )
+// ^ と $ はパターンの先頭と末尾でだけ行頭・行末を表す
+
+enum editorReNodeType {
+    RE_N_SET,   // 1文字 (setに含まれる文字)
+    RE_N_EMPTY, // 空文字列
+    RE_N_CAT,   // a b
+    RE_N_ALT,   // a | b
+    RE_N_STAR,  // a*
+    RE_N_PLUS,  // a+
+    RE_N_QUEST  // a?
+};
+
+struct editorReNode {
+    int type;
+    int a, b; // 子の添字
+    unsigned char set[32];
+};
+
+enum editorReStateType {
+    RE_SET,   // setに含まれる文字を読んでoutへ
+    RE_SPLIT, // 何も読まずにoutとout1の両方へ
+    RE_MATCH
+};
+
+struct editorReState {
+    int type;
+    int out, out1;
+    unsigned char set[32];
+};
+
+struct editorReNfa {
+    struct editorReState *s;
+    int n;
+    int cap;
+    int start;
+};
+
+struct editorRegex {
+    struct editorReNode *node; // 構文木 (コンパイル中だけ使う)
+    int nnode;
+    int nodecap;
+    const char *p; // 構文解析中の位置
+    int bol;       // ^ で始まる
+    int eol;       // $ で終わる
+    struct editorReNfa fwd; // 前から読むNFA
+    struct editorReNfa rev; // パターンを逆順にしたNFA (後ろから読んでマッチの開始位置を探す)
+};
+
+#define RE_UNKNOWN -2 // まだ計算していない遷移
+#define RE_DEAD -1    // これ以上読んでもマッチしない
+
+struct editorReDfaState {
+    int *set; // NFAの状態 (RE_SETとRE_MATCHだけ、添字順)
+    int nset;
+    int match;
+    int next[256];
+};
+
+// 状態はKILO_RE_STATESまでキャッシュし、溢れたら全部捨てて作り直す
+// unanchoredの場合は毎回NFAの開始状態を足しながら進む (どこからでもマッチを始められる)
+struct editorReDfa {
+    const struct editorReNfa *nfa;
+    int unanchored;
+    struct editorReDfaState *states[KILO_RE_STATES];
+    int n;
+    int hash[KILO_RE_STATES * 2]; // 状態の添字 (-1は空き)
+    int *startset; // NFAの開始状態から何も読まずに行ける状態
+    int nstartset;
+    int *mark;     // 集合を作る時の印 (NFAの状態ごと)
+    int markgen;
+    int *tmp;
+    int start;     // 最初の状態 (-1なら作り直す)
+    int flushes;   // キャッシュを捨てた回数
+};
+
+struct editorReSeen {
+    int pos;
+    int id;
+    unsigned int gen;
+};
+
+// 1つのスレッドで使う照合器。DFAのキャッシュを書き換えるのでスレッドごとに作る
+struct editorReMatcher {
+    const struct editorRegex *re;
+    struct editorReDfa fwd; // マッチの開始位置から終わりを探す
+    struct editorReDfa rev; // 行を後ろから読んでマッチの開始位置を探す
+    unsigned char *starts;  // starts[i]: iから始まるマッチがある
+    int startcap;
+    unsigned char first[32]; // マッチの最初の文字になりうる文字
+    int firstc;              // firstが1文字だけならその文字 (それ以外は-1)
+    // 今の行で前のマッチの終わりを探した時に通った (位置, fwdの状態) の組
+    // 同じ組に来たら、そこから先は前に読んだ時と同じでマッチは無いので読むのをやめる
+    // 組は行の長さ×DFAの状態数しか無いので、1行の全マッチを探しても読む量は行の長さに比例する
+    struct editorReSeen *seen;
+    int seencap;      // 2の累乗
+    int nseen;
+    unsigned int seengen; // genがこれと同じものだけが今の行で記録したもの
+    int seenflushes;      // 記録した時のfwd.flushes (キャッシュを捨てると状態の添字が変わる)
+};
+
+int editorReNewNode(struct editorRegex *re, int type, int a, int b) {
+    if (re->nnode == re->nodecap) {
+        re->nodecap = re->nodecap ? re->nodecap * 2 : 32;
+        re->node = realloc(re->node, sizeof(struct editorReNode) * re->nodecap);
+        if (re->node == NULL) die("realloc");
+    }
+    struct editorReNode *n = &re->node[re->nnode];
+    n->type = type;
+    n->a = a;
+    n->b = b;
+    memset(n->set, 0, sizeof(n->set));
+    return re->nnode++;
+}
+
+void editorReSetAdd(unsigned char *set, int c) {
+    set[c >> 3] |= 1 << (c & 7);
+}
+
+// \d \w \s などの文字の種類をsetに足す。エスケープでなければ0を返す
+int editorReClassEscape(unsigned char *set, int c) {
+    int neg = isupper(c);
+    int k;
+    unsigned char cls[32] = { 0 };
+    switch (tolower(c)) {
+    case 'd':
+        for (k = '0'; k <= '9'; k++) editorReSetAdd(cls, k);
+        break;
+    case 'w':
+        for (k = 0; k < 256; k++)
+            if (isalnum(k) || k == '_') editorReSetAdd(cls, k);
+        break;
+    case 's':
+        for (k = 0; k < 256; k++)
+            if (isspace(k)) editorReSetAdd(cls, k);
+        break;
+    default:
+        return 0;
+    }
+    for (k = 0; k < 32; k++)
+        set[k] |= neg ? ~cls[k] : cls[k];
+    return 1;
+}
+
+int editorReEscapeChar(int c) {
+    switch (c) {
+    case 't': return '\t';
+    case 'n': return '\n';
+    case 'r': return '\r';
+    }
+    return c;
+}
+
+int editorReParseAlt(struct editorRegex *re);
+
+// [...] の中身。閉じていなければ-1
+int editorReParseClass(struct editorRegex *re) {
+    int n = editorReNewNode(re, RE_N_SET, -1, -1);
+    unsigned char set[32] = { 0 };
+    int neg = 0;
+    if (*re->p == '^') {
+        neg = 1;
+        re->p++;
+    }
+    int first = 1;
+    while (*re->p && (*re->p != ']' || first)) {
+        first = 0;
+        int c = (unsigned char)*re->p++;
+        if (c == '\\' && *re->p) {
+            c = (unsigned char)*re->p++;
+            if (editorReClassEscape(set, c))
+                continue;
+            c = editorReEscapeChar(c);
+        }
+        int hi = c;
+        if (re->p[0] == '-' && re->p[1] && re->p[1] != ']') {
+            hi = (unsigned char)re->p[1];
+            re->p += 2;
+            if (hi == '\\' && *re->p)
+                hi = editorReEscapeChar((unsigned char)*re->p++);
+        }
+        for (; c <= hi; c++)
+            editorReSetAdd(set, c);
+    }
+    if (*re->p != ']')
+        return -1;
+    re->p++;
+    int k;
+    for (k = 0; k < 32; k++)
+        re->node[n].set[k] = neg ? ~set[k] : set[k];
+    return n;
+}
+
+int editorReParseAtom(struct editorRegex *re) {
+    int c = (unsigned char)*re->p++;
+    int n;
+    switch (c) {
+    case '(':
+        n = editorReParseAlt(re);
+        if (n == -1 || *re->p != ')')
+            return -1;
+        re->p++;
+        return n;
+    case '[':
+        return editorReParseClass(re);
+    case '.':
+        n = editorReNewNode(re, RE_N_SET, -1, -1);
+        memset(re->node[n].set, 0xff, 32);
+        return n;
+    case '*': case '+': case '?': case ')':
+        return -1;
+    case '\\':
+        if (*re->p == '\0')
+            return -1;
+        c = (unsigned char)*re->p++;
+        n = editorReNewNode(re, RE_N_SET, -1, -1);
+        if (!editorReClassEscape(re->node[n].set, c))
+            editorReSetAdd(re->node[n].set, editorReEscapeChar(c));
+        return n;
+    }
+    n = editorReNewNode(re, RE_N_SET, -1, -1);
+    editorReSetAdd(re->node[n].set, c);
+    return n;
+}
+
+int editorReParseRepeat(struct editorRegex *re) {
+    int n = editorReParseAtom(re);
+    while (n != -1) {
+        int type;
+        switch (*re->p) {
+        case '*': type = RE_N_STAR; break;
+        case '+': type = RE_N_PLUS; break;
+        case '?': type = RE_N_QUEST; break;
+        default: return n;
+        }
+        re->p++;
+        n = editorReNewNode(re, type, n, -1);
+    }
+    return n;
+}
+
+int editorReParseCat(struct editorRegex *re) {
+    int n = editorReNewNode(re, RE_N_EMPTY, -1, -1);
+    while (*re->p && *re->p != '|' && *re->p != ')') {
+        int m = editorReParseRepeat(re);
+        if (m == -1)
+            return -1;
+        n = editorReNewNode(re, RE_N_CAT, n, m);
+    }
+    return n;
+}
+
+int editorReParseAlt(struct editorRegex *re) {
+    int n = editorReParseCat(re);
+    while (n != -1 && *re->p == '|') {
+        re->p++;
+        int m = editorReParseCat(re);
+        if (m == -1)
+            return -1;
+        n = editorReNewNode(re, RE_N_ALT, n, m);
+    }
+    return n;
+}
+
+int editorReNewState(struct editorReNfa *nfa, int type, int out, int out1) {
+    if (nfa->n == nfa->cap) {
+        nfa->cap = nfa->cap ? nfa->cap * 2 : 32;
+        nfa->s = realloc(nfa->s, sizeof(struct editorReState) * nfa->cap);
+        if (nfa->s == NULL) die("realloc");
+    }
+    struct editorReState *s = &nfa->s[nfa->n];
+    s->type = type;
+    s->out = out;
+    s->out1 = out1;
+    return nfa->n++;
+}
+
+// 構文木のnを読んだらnextに進むNFAを作り、その開始状態を返す
+// reverseなら連結を逆順にする (パターンを後ろから読むNFA)
+int editorReBuild(struct editorRegex *re, struct editorReNfa *nfa, int n, int next, int reverse) {
+    struct editorReNode *node = &re->node[n];
+    int s;
+    switch (node->type) {
+    case RE_N_SET:
+        s = editorReNewState(nfa, RE_SET, next, -1);
+        memcpy(nfa->s[s].set, node->set, 32);
+        return s;
+    case RE_N_EMPTY:
+        return next;
+    case RE_N_CAT:
+        if (reverse)
+            return editorReBuild(re, nfa, node->b, editorReBuild(re, nfa, node->a, next, reverse), reverse);
+        return editorReBuild(re, nfa, node->a, editorReBuild(re, nfa, node->b, next, reverse), reverse);
+    case RE_N_ALT: {
+        int a = editorReBuild(re, nfa, node->a, next, reverse);
+        int b = editorReBuild(re, nfa, node->b, next, reverse);
+        return editorReNewState(nfa, RE_SPLIT, a, b);
+    }
+    case RE_N_QUEST: {
+        int a = editorReBuild(re, nfa, node->a, next, reverse);
+        return editorReNewState(nfa, RE_SPLIT, a, next);
+    }
+    case RE_N_STAR:
+        s = editorReNewState(nfa, RE_SPLIT, -1, next);
+        nfa->s[s].out = editorReBuild(re, nfa, node->a, s, reverse);
+        return s;
+    case RE_N_PLUS:
+        s = editorReNewState(nfa, RE_SPLIT, -1, next);
+        nfa->s[s].out = editorReBuild(re, nfa, node->a, s, reverse);
+        return nfa->s[s].out;
+    }
+    return next;
+}
+
+void editorReFree(struct editorRegex *re) {
+    if (re == NULL)
+        return;
+    free(re->node);
+    free(re->fwd.s);
+    free(re->rev.s);
+    free(re);
+}
+
+// パターンをコンパイルする。構文が正しくなければNULL
+struct editorRegex *editorReCompile(const char *pattern) {
+    struct editorRegex *re = calloc(1, sizeof(struct editorRegex));
+    if (re == NULL) die("calloc");
+    char *pat = strdup(pattern);
+    char *p = pat;
+    size_t len = strlen(p);
+    if (*p == '^') {
+        re->bol = 1;
+        p++;
+        len--;
+    }
+    // 末尾の$はエスケープされていなければ行末
+    if (len > 0 && p[len - 1] == '$') {
+        size_t k = len - 1;
+        while (k > 0 && p[k - 1] == '\\')
+            k--;
+        if ((len - 1 - k) % 2 == 0) {
+            re->eol = 1;
+            p[len - 1] = '\0';
+        }
+    }
+
+    re->p = p;
+    int root = editorReParseAlt(re);
+    if (root == -1 || *re->p != '\0') {
+        free(pat);
+        editorReFree(re);
+        return NULL;
+    }
+    free(pat);
+    re->p = NULL;
+
+    int m = editorReNewState(&re->fwd, RE_MATCH, -1, -1);
+    re->fwd.start = editorReBuild(re, &re->fwd, root, m, 0);
+    m = editorReNewState(&re->rev, RE_MATCH, -1, -1);
+    re->rev.start = editorReBuild(re, &re->rev, root, m, 1);
+    return re;
+}
+
+// sから何も読まずに行ける状態に印を付ける
+void editorReMark(struct editorReDfa *d, int s) {
+    while (s != -1 && d->mark[s] != d->markgen) {
+        d->mark[s] = d->markgen;
+        const struct editorReState *st = &d->nfa->s[s];
+        if (st->type != RE_SPLIT)
+            return;
+        editorReMark(d, st->out1);
+        s = st->out;
+    }
+}
+
+// 印の付いた状態をd->tmpに添字順に集める
+int editorReCollect(struct editorReDfa *d) {
+    int n = 0;
+    int s;
+    for (s = 0; s < d->nfa->n; s++)
+        if (d->mark[s] == d->markgen && d->nfa->s[s].type != RE_SPLIT)
+            d->tmp[n++] = s;
+    return n;
+}
+
+void editorReDfaFlush(struct editorReDfa *d) {
+    int i;
+    for (i = 0; i < d->n; i++) {
+        free(d->states[i]->set);
+        free(d->states[i]);
+    }
+    d->n = 0;
+    for (i = 0; i < KILO_RE_STATES * 2; i++)
+        d->hash[i] = -1;
+    d->start = -1;
+    d->flushes++;
+}
+
+// 集合setのDFAの状態を返す (無ければ作る)
+// キャッシュが一杯なら全部捨てるので、それまでの状態の添字は使えなくなる
+int editorReDfaAdd(struct editorReDfa *d, const int *set, int nset) {
+    unsigned int h = 2166136261u;
+    int i;
+    for (i = 0; i < nset; i++)
+        h = (h ^ set[i]) * 16777619u;
+    unsigned int slot = h % (KILO_RE_STATES * 2);
+    while (d->hash[slot] != -1) {
+        struct editorReDfaState *st = d->states[d->hash[slot]];
+        if (st->nset == nset && (nset == 0 || memcmp(st->set, set, sizeof(int) * nset) == 0))
+            return d->hash[slot];
+        slot = (slot + 1) % (KILO_RE_STATES * 2);
+    }
+    if (d->n == KILO_RE_STATES) {
+        editorReDfaFlush(d);
+        return editorReDfaAdd(d, set, nset);
+    }
+
+    struct editorReDfaState *st = malloc(sizeof(struct editorReDfaState));
+    if (st == NULL) die("malloc");
+    st->set = malloc(sizeof(int) * (nset + 1));
+    if (nset > 0)
+        memcpy(st->set, set, sizeof(int) * nset);
+    st->nset = nset;
+    st->match = 0;
+    for (i = 0; i < nset; i++)
+        if (d->nfa->s[set[i]].type == RE_MATCH)
+            st->match = 1;
+    for (i = 0; i < 256; i++)
+        st->next[i] = RE_UNKNOWN;
+    d->states[d->n] = st;
+    d->hash[slot] = d->n;
+    return d->n++;
+}
+
+void editorReDfaInit(struct editorReDfa *d, const struct editorReNfa *nfa, int unanchored) {
+    d->nfa = nfa;
+    d->unanchored = unanchored;
+    d->n = 0;
+    d->flushes = 0;
+    d->mark = calloc(nfa->n, sizeof(int));
+    d->tmp = malloc(sizeof(int) * nfa->n);
+    d->startset = malloc(sizeof(int) * nfa->n);
+    if (d->mark == NULL || d->tmp == NULL || d->startset == NULL) die("malloc");
+    d->markgen = 1;
+    editorReMark(d, nfa->start);
+    d->nstartset = editorReCollect(d);
+    memcpy(d->startset, d->tmp, sizeof(int) * d->nstartset);
+    editorReDfaFlush(d);
+}
+
+void editorReDfaFree(struct editorReDfa *d) {
+    editorReDfaFlush(d);
+    free(d->mark);
+    free(d->tmp);
+    free(d->startset);
+}
+
+// 最初の状態。unanchoredなら空集合から始め、読むたびに開始状態を足す
+int editorReDfaStart(struct editorReDfa *d) {
+    if (d->start == -1)
+        d->start = d->unanchored ? editorReDfaAdd(d, NULL, 0)
+            : editorReDfaAdd(d, d->startset, d->nstartset);
+    return d->start;
+}
+
+// 状態idで文字cを読んだ次の状態
+static inline int editorReDfaNext(struct editorReDfa *d, int id, unsigned char c) {
+    struct editorReDfaState *st = d->states[id];
+    if (st->next[c] != RE_UNKNOWN)
+        return st->next[c];
+
+    d->markgen++;
+    int i;
+    for (i = 0; i < st->nset; i++) {
+        const struct editorReState *s = &d->nfa->s[st->set[i]];
+        if (s->type == RE_SET && (s->set[c >> 3] & (1 << (c & 7))))
+            editorReMark(d, s->out);
+    }
+    if (d->unanchored) {
+        for (i = 0; i < d->nstartset; i++) {
+            const struct editorReState *s = &d->nfa->s[d->startset[i]];
+            if (s->type == RE_SET && (s->set[c >> 3] & (1 << (c & 7))))
+                editorReMark(d, s->out);
+        }
+    }
+    int n = editorReCollect(d);
+    if (n == 0 && !d->unanchored) {
+        st->next[c] = RE_DEAD;
+        return RE_DEAD;
+    }
+    int flushes = d->flushes;
+    int next = editorReDfaAdd(d, d->tmp, n);
+    // キャッシュを捨てた場合はstも無くなっている
+    if (d->flushes == flushes)
+        st->next[c] = next;
+    return next;
+}
+
+void editorReMatcherInit(struct editorReMatcher *m, const struct editorRegex *re) {
+    m->re = re;
+    editorReDfaInit(&m->fwd, &re->fwd, 0);
+    // $で終わる場合は行末で終わるマッチしか探さない
+    editorReDfaInit(&m->rev, &re->rev, !re->eol);
+    // 開始状態から読める文字を集める (マッチは空でないので、必ずそのどれかから始まる)
+    memset(m->first, 0, sizeof(m->first));
+    int i, c;
+    for (i = 0; i < m->fwd.nstartset; i++) {
+        const struct editorReState *s = &re->fwd.s[m->fwd.startset[i]];
+        if (s->type == RE_SET)
+            for (c = 0; c < 32; c++)
+                m->first[c] |= s->set[c];
+    }
+    m->firstc = -1;
+    for (c = 0; c < 256; c++) {
+        if (!(m->first[c >> 3] & (1 << (c & 7))))
+            continue;
+        if (m->firstc != -1) {
+            m->firstc = -1;
+            break;
+        }
+        m->firstc = c;
+    }
+    m->starts = NULL;
+    m->startcap = 0;
+    m->seen = NULL;
+    m->seencap = 0;
+    m->nseen = 0;
+    m->seengen = 0;
+    m->seenflushes = 0;
+}
+
+void editorReMatcherFree(struct editorReMatcher *m) {
+    editorReDfaFree(&m->fwd);
+    editorReDfaFree(&m->rev);
+    free(m->starts);
+    free(m->seen);
+}
+
+// 記録した (位置, 状態) の組を全部忘れる
+void editorReSeenReset(struct editorReMatcher *m) {
+    m->nseen = 0;
+    m->seenflushes = m->fwd.flushes;
+    if (++m->seengen == 0) {
+        // 一周したら古い記録と区別できないので消す
+        int i;
+        for (i = 0; i < m->seencap; i++)
+            m->seen[i].gen = 0;
+        m->seengen = 1;
+    }
+}
+
+// (pos, id)を記録する。既に記録されていれば1を返す
+int editorReSeenAdd(struct editorReMatcher *m, int pos, int id) {
+    if (m->fwd.flushes != m->seenflushes)
+        editorReSeenReset(m);
+    if ((m->nseen + 1) * 2 > m->seencap) {
+        // 今の行の記録だけを大きい表に入れ直す
+        struct editorReSeen *old = m->seen;
+        int oldcap = m->seencap;
+        m->seencap = m->seencap ? m->seencap * 2 : 1024;
+        m->seen = calloc(m->seencap, sizeof(struct editorReSeen));
+        if (m->seen == NULL) die("calloc");
+        int i;
+        m->nseen = 0;
+        for (i = 0; i < oldcap; i++)
+            if (old[i].gen == m->seengen)
+                editorReSeenAdd(m, old[i].pos, old[i].id);
+        free(old);
+    }
+    unsigned int slot = ((unsigned int)pos * 2654435761u ^ (unsigned int)id * 40503u) & (m->seencap - 1);
+    while (m->seen[slot].gen == m->seengen) {
+        if (m->seen[slot].pos == pos && m->seen[slot].id == id)
+            return 1;
+        slot = (slot + 1) & (m->seencap - 1);
+    }
+    m->seen[slot].pos = pos;
+    m->seen[slot].id = id;
+    m->seen[slot].gen = m->seengen;
+    m->nseen++;
+    return 0;
+}
+
+// sの中でマッチの最初の文字になりうる文字が最初に出てくる位置 (無ければlen)
+// 1文字だけならmemchrで探す
+int editorReFirstByte(struct editorReMatcher *m, const char *s, int len) {
+    if (m->firstc != -1) {
+        const char *p = memchr(s, m->firstc, len);
+        return p ? p - s : len;
+    }
+    int i;
+    for (i = 0; i < len; i++) {
+        unsigned char c = s[i];
+        if (m->first[c >> 3] & (1 << (c & 7)))
+            break;
+    }
+    return i;
+}
+
+// 行sを後ろから1回だけ読み、各位置から始まる (空でない) マッチがあるかをm->startsに記録する
+// マッチの最初の文字になりうる文字が最初に出てくる所より前は読まない
+// (その文字を含まない行はDFAで1文字ずつ読まずに済む)
+void editorReFindStarts(struct editorReMatcher *m, const char *s, int len) {
+    editorReSeenReset(m);
+    if (len == 0)
+        return;
+    if (len > m->startcap) {
+        m->startcap = len * 2;
+        m->starts = realloc(m->starts, m->startcap);
+        if (m->starts == NULL) die("realloc");
+    }
+    memset(m->starts, 0, len);
+    int first = editorReFirstByte(m, s, len);
+    if (first == len)
+        return;
+    struct editorReDfa *d = &m->rev;
+    int id = editorReDfaStart(d);
+    int i;
+    for (i = len - 1; i >= first; i--) {
+        id = editorReDfaNext(d, id, s[i]);
+        if (id == RE_DEAD)
+            break;
+        m->starts[i] = d->states[id]->match;
+    }
+}
+
+// from以降で最初に始まるマッチの位置を返し、最長の長さを*mlenに入れる (無ければ-1)
+// 先にeditorReFindStartsでその行の開始位置を調べておき、fromは前のマッチの終わりより後ろにする
+// (x|x.*y を xxx... で探す時のように、マッチごとに行末まで読み直すと行の長さの2乗かかるので、
+// 前に読んだ時と同じ位置で同じ状態になったら読むのをやめる。
+// 前のマッチはどれもfromより前で終わっているので、その先にマッチが無いことは分かっている)
+int editorReNextMatch(struct editorReMatcher *m, const char *s, int len, int from, int *mlen) {
+    int i;
+    for (i = from; i < len; i++) {
+        // 次にマッチが始まる位置まで飛ばす
+        const unsigned char *p = memchr(&m->starts[i], 1, len - i);
+        if (p == NULL)
+            return -1;
+        i = p - m->starts;
+        if (m->re->bol && i > 0)
+            return -1;
+
+        struct editorReDfa *d = &m->fwd;
+        int id = editorReDfaStart(d);
+        int end = -1;
+        int j;
+        for (j = i; j < len; j++) {
+            id = editorReDfaNext(d, id, s[j]);
+            if (id == RE_DEAD || editorReSeenAdd(m, j, id))
+                break;
+            if (d->states[id]->match && (!m->re->eol || j == len - 1))
+                end = j + 1;
+        }
+        if (end != -1) {
+            *mlen = end - i;
+            return i;
+        }
+    }
+    return -1;
+}
+
+/** find ***/
+
+// hayの中からneedleを探す (memmemと同じ)
+// 先頭と末尾の文字が両方一致する位置を16バイトずつまとめて絞り込み、候補だけを比べる
+// SSE2が使えない環境では先頭の文字をmemchrで探す
+const char *editorFindInRow(const char *hay, size_t hlen, const char *needle, size_t nlen) {
+    if (nlen == 0)
+        return hay;
+    if (nlen > hlen)
+        return NULL;
+    if (nlen == 1)
+        return memchr(hay, needle[0], hlen);
+
+    const char *p = hay;
+    const char *end = hay + hlen - nlen + 1; // ここより前がマッチの開始位置の候補
+#ifdef __SSE2__
+    __m128i first = _mm_set1_epi8(needle[0]);
+    __m128i last = _mm_set1_epi8(needle[nlen - 1]);
+    while (end - p >= 16) {
+        __m128i bf = _mm_loadu_si128((const __m128i *)p);
+        __m128i bl = _mm_loadu_si128((const __m128i *)(p + nlen - 1));
+        unsigned int mask = _mm_movemask_epi8(
+            _mm_and_si128(_mm_cmpeq_epi8(bf, first), _mm_cmpeq_epi8(bl, last)));
+        while (mask) {
+            int bit = __builtin_ctz(mask);
+            if (memcmp(p + bit + 1, needle + 1, nlen - 2) == 0)
+                return p + bit;
+            mask &= mask - 1;
+        }
+        p += 16;
+    }
+#endif
+    while (p < end) {
+        p = memchr(p, needle[0], end - p);
+        if (p == NULL)
+            return NULL;
+        if (p[nlen - 1] == needle[nlen - 1] && memcmp(p + 1, needle + 1, nlen - 2) == 0)
+            return p;
+        p++;
+    }
+    return NULL;
 }
 
-void editorDelRow(int at) {
-    if (at < 0 || at >= E.numrows)
+void editorMatchReserve(struct editorMatchList *l, int n) {
+    if (n <= l->cap)
         return;
-    editorFreeRow(&E.row[at]);
-    memmove(&E.row[at], &E.row[at + 1], sizeof(erow) * (E.numrows - at - 1));
-    E.numrows--;
-    E.dirty++;
+    int cap = l->cap ? l->cap : 64;
+    while (cap < n)
+        cap *= 2;
+    l->m = realloc(l->m, sizeof(struct editorMatch) * cap);
+    if (l->m == NULL) die("realloc");
+    l->cap = cap;
 }
 
-// ここの *rowは配列ではなく構造体へのポインタ
-void editorRowInsertChar(erow *row, int at, int c) {
-    if (at < 0 || at > row->size)
-        at = row->size;
-    // memmoveを使って文字列に文字を挿入する、memcpyだとoverlapしているので問題になるのでmemmoveを使う
-    row->chars = realloc(row->chars, row->size + 2); // 1文字+NULLバイト
-    memmove(&row->chars[at + 1], &row->chars[at], row->size - at + 1);
-    row->size++;
-    row->chars[at] = c;
-    editorUpdateRow(row);
-    E.dirty++;
+void editorMatchPush(struct editorMatchList *l, int row, int col, int len) {
+    editorMatchReserve(l, l->n + 1);
+    l->m[l->n].row = row;
+    l->m[l->n].col = col;
+    l->m[l->n].len = len;
+    l->n++;
 }
 
-void editorRowAppendString(erow *row, char *s, size_t len) {
-    row->chars = realloc(row->chars, row->size + len + 1);
-    memcpy(&row->chars[row->size], s, len);
-    row->size += len;
-    row->chars[row->size] = '\0';
-    editorUpdateRow(row);
-    E.dirty++;
+// 行[from, to)の中の検索語の出現位置 (重ならないもの) を全部lに追加する
+// 正規表現の場合はrmで探す (rmはスレッドごとに別のものを使う)
+void editorFindScanRows(struct editorMatchList *l, int from, int to, struct editorReMatcher *rm) {
+    int j;
+    for (j = from; j < to; j++) {
+        erow *row = editorRow(j);
+        if (E.find_regex) {
+            if (rm == NULL)
+                return; // 正しくない正規表現
+            editorReFindStarts(rm, row->chars, row->size);
+            int at = 0, len;
+            while ((at = editorReNextMatch(rm, row->chars, row->size, at, &len)) != -1) {
+                editorMatchPush(l, j, at, len);
+                at += len;
+            }
+            continue;
+        }
+        const char *p = row->chars;
+        const char *end = row->chars + row->size;
+        const char *match;
+        while ((match = editorFindInRow(p, end - p, E.find_query, E.find_qlen)) != NULL) {
+            editorMatchPush(l, j, match - row->chars, E.find_qlen);
+            p = match + E.find_qlen;
+        }
+    }
 }
 
-void editorRowDelChar(erow *row, int at) {
-    if (at < 0 || at >= row->size)
-        return;
-    memmove(&row->chars[at], &row->chars[at + 1], row->size - at);
-    row->size--;
-    editorUpdateRow(row);
-    E.dirty++;
-}
+struct findChunk {
+    pthread_t thread;
+    int from;
+    int to;
+    struct editorMatchList list;
+};
 
-/*** editor operations ***/
+void *editorFindChunk(void *arg) {
+    struct findChunk *c = arg;
+    if (E.find_re) {
+        struct editorReMatcher rm;
+        editorReMatcherInit(&rm, E.find_re);
+        editorFindScanRows(&c->list, c->from, c->to, &rm);
+        editorReMatcherFree(&rm);
+    } else {
+        editorFindScanRows(&c->list, c->from, c->to, NULL);
+    }
+    return NULL;
+}
 
-void editorInsertChar(int c) {
-    if (E.cy == E.numrows) {
-        // 最後の行の場合は空白を挿入
-        editorInsertRow(E.numrows, "", 0);
+void editorFindClear() {
+    free(E.find_query);
+    E.find_query = NULL;
+    E.find.n = 0;
+    if (E.find_rm) {
+        editorReMatcherFree(E.find_rm);
+        free(E.find_rm);
+        E.find_rm = NULL;
     }
-    editorRowInsertChar(&E.row[E.cy], E.cx, c);
-    E.cx++;
+    editorReFree(E.find_re);
+    E.find_re = NULL;
 }
 
-void editorInsertNewLine() {
-    if (E.cx == 0) {
-        // 行頭の場合空行をinsert
-        editorInsertRow(E.cy, "", 0);
-    } else {
-        erow *row = &E.row[E.cy];
-        // 現在のカーソル位置から右側を取り出し下の行に挿入する
-        editorInsertRow(E.cy + 1, &row->chars[E.cx], row->size - E.cx);
+// queryの全件検索の索引を作る
+// 行を分けて複数のスレッドで探し、行の順に繋げるので索引は最初から整列している
+// 今の索引を、検索語をqueryに伸ばした時の索引に絞り込めるか
+// queryの出現は前の検索語の出現のどれかと同じ位置から始まるので、前の索引を見直すだけで済む
+int editorFindCanNarrow(const char *query) {
+    if (E.find_query == NULL || E.find_regex || E.find_re != NULL)
+        return 0;
+    return (int)strlen(query) >= E.find_qlen && memcmp(query, E.find_query, E.find_qlen) == 0;
+}
 
-        // カーソル位置の行を切り詰める
-        row = &E.row[E.cy]; // reallocでアドレスが変わっている可能性があるので再代入
-        row->size = E.cx;
-        row->chars[row->size] = '\0';
-        editorUpdateRow(row);
+// 前の索引から、queryにマッチするものだけを残す (検索語を後ろに1文字ずつ打っている時)
+// 前の検索語が自分自身と重なって出現しうる場合 (abcabのように先頭と末尾に同じ文字列がある)、
+// 索引は重ならない分しか持っていないので、各マッチの中の重なりうる位置 (shift) も調べる
+// 索引に無い出現は、その直前のマッチと重なっていたはずなので、これで全部の候補になる
+void editorFindNarrow(const char *query) {
+    int qlen = strlen(query);
+    int oldlen = E.find_qlen;
+    int *shift = malloc(sizeof(int) * oldlen);
+    if (shift == NULL) die("malloc");
+    int nshift = 0;
+    int k;
+    for (k = 0; k < oldlen; k++)
+        if (k == 0 || memcmp(E.find_query, E.find_query + k, oldlen - k) == 0)
+            shift[nshift++] = k;
+
+    int prevrow = -1, prevend = 0;
+    int n = 0;
+    int i;
+    for (i = 0; i < E.find.n; i++) {
+        struct editorMatch m = E.find.m[i];
+        erow *row = editorRow(m.row);
+        int col = m.col;
+        for (k = 0; k < nshift; k++) {
+            m.col = col + shift[k];
+            if (m.col + qlen > row->size)
+                break;
+            if (memcmp(&row->chars[m.col], query, qlen) != 0)
+                continue;
+            if (m.row == prevrow && m.col < prevend)
+                continue; // 前のマッチと重なる (行を探した時と同じく左から重ならないものを取る)
+            m.len = qlen;
+            // 1つのマッチの中の候補は互いに重なる (qlen >= oldlen) ので残るのは1つまで
+            // なので詰めて書いてもまだ読んでいないE.find.m[i + 1]以降は上書きしない
+            E.find.m[n++] = m;
+            prevrow = m.row;
+            prevend = m.col + qlen;
+        }
     }
-    E.cy++;
-    E.cx = 0;
+    free(shift);
+    E.find.n = n;
+    free(E.find_query);
+    E.find_query = strdup(query);
+    E.find_qlen = qlen;
 }
 
-void editorDelChar() {
-    if (E.cy == E.numrows) // 末尾の場合は行がまだないのでスキップ
+void editorFindBuild(const char *query) {
+    if (editorFindCanNarrow(query)) {
+        editorFindNarrow(query);
         return;
-    if (E.cx == 0 && E.cy == 0) // 一番上の場合は上の行がないのでスキップ
+    }
+    editorFindClear();
+    if (query[0] == '\0')
         return;
+    E.find_query = strdup(query);
+    E.find_qlen = strlen(query);
+    if (E.find_regex) {
+        // 正規表現は検索語が変わるたびに1回だけコンパイルする
+        E.find_re = editorReCompile(query);
+        if (E.find_re == NULL)
+            return;
+        E.find_rm = malloc(sizeof(struct editorReMatcher));
+        if (E.find_rm == NULL) die("malloc");
+        editorReMatcherInit(E.find_rm, E.find_re);
+    }
 
-    erow *row = &E.row[E.cy];
-    if (E.cx > 0) {
-        // カーソル位置の左の文字を消すので-1している
-        editorRowDelChar(row, E.cx - 1);
-        E.cx--;
-    } else {
-        // 行頭の場合は上の行にコピーしつつ行を削除
-        E.cx = E.row[E.cy - 1].size; // 上の行の末尾に移動
-        editorRowAppendString(&E.row[E.cy - 1], row->chars, row->size); // 上の行の末尾に今の行をコピー
-        editorDelRow(E.cy);
-        E.cy--;
+    int nchunks = editorThreadCount(E.numrows / KILO_FIND_CHUNK);
+    struct findChunk chunks[KILO_THREADS];
+    int started[KILO_THREADS] = { 0 };
+    int i;
+    for (i = 0; i < nchunks; i++) {
+        chunks[i].from = (long long)E.numrows * i / nchunks;
+        chunks[i].to = (long long)E.numrows * (i + 1) / nchunks;
+        chunks[i].list.m = NULL;
+        chunks[i].list.n = 0;
+        chunks[i].list.cap = 0;
+    }
+    for (i = 1; i < nchunks; i++)
+        started[i] = pthread_create(&chunks[i].thread, NULL, editorFindChunk, &chunks[i]) == 0;
+    editorFindChunk(&chunks[0]);
+    for (i = 0; i < nchunks; i++) {
+        if (started[i])
+            pthread_join(chunks[i].thread, NULL);
+        else if (i > 0)
+            editorFindChunk(&chunks[i]);
+        if (chunks[i].list.n > 0) {
+            editorMatchReserve(&E.find, E.find.n + chunks[i].list.n);
+            memcpy(&E.find.m[E.find.n], chunks[i].list.m,
+                sizeof(struct editorMatch) * chunks[i].list.n);
+            E.find.n += chunks[i].list.n;
+        }
+        free(chunks[i].list.m);
     }
 }
 
-/*** file i/o ***/
-
-// 構造体に保存している*rowから1つの大きな文字列を作って返す
-char *editorRowsToString(int *buflen) {
-    int totlen = 0;
-    int j;
-    for (j = 0; j < E.numrows; j++)
-        totlen += E.row[j].size + 1; // 改行文字
-    *buflen = totlen;
-
-    char *buf = malloc(totlen);
-    char *p = buf;
-    for (j = 0; j < E.numrows; j++) {
-        memcpy(p, E.row[j].chars, E.row[j].size);
-        p += E.row[j].size;
-        // 改行を挿入
-        *p = '\n';
-        p++;
+// (row, col)以降で最初のマッチの添字 (無ければE.find.n)
+int editorFindLowerBound(int row, int col) {
+    int lo = 0, hi = E.find.n;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        struct editorMatch *m = &E.find.m[mid];
+        if (m->row < row || (m->row == row && m->col < col))
+            lo = mid + 1;
+        else
+            hi = mid;
     }
+    return lo;
+}
 
-    return buf;
+// 索引の[lo, hi)をsrcのn個で置き換える
+void editorFindSplice(int lo, int hi, struct editorMatch *src, int n) {
+    editorMatchReserve(&E.find, E.find.n - (hi - lo) + n);
+    // 索引が空の時はE.find.mがNULLのことがあり、NULLをmemmove/memcpyに渡すのは未定義動作
+    if (E.find.n > hi)
+        memmove(&E.find.m[lo + n], &E.find.m[hi], sizeof(struct editorMatch) * (E.find.n - hi));
+    if (n > 0)
+        memcpy(&E.find.m[lo], src, sizeof(struct editorMatch) * n);
+    E.find.n += n - (hi - lo);
 }
 
-void editorOpen(char *filename) {
-    // これ必要か？
-    free(E.filename);
-    E.filename = strdup(filename);
-    FILE *fp = fopen(filename, "r");
-    if (!fp) die("fopen");
+// 行atが書き換わったので、その行のマッチだけ探し直す
+void editorFindRowChanged(int at) {
+    if (E.find_query == NULL)
+        return;
+    struct editorMatchList l = { NULL, 0, 0 };
+    editorFindScanRows(&l, at, at + 1, E.find_rm);
+    editorFindSplice(editorFindLowerBound(at, 0), editorFindLowerBound(at + 1, 0), l.m, l.n);
+    free(l.m);
+}
 
-    char *line = NULL;
-    size_t linecap = 0;
-    ssize_t linelen;
-    while ((linelen = getline(&line, &linecap, fp)) != -1) {
-        while (linelen > 0 && (line[linelen - 1] == '\n' ||
-                            line[linelen - 1] == '\r')) {
-            // 改行文字がlinelenに入っているので、改行があった場合に文字数をその分減らす
-            // abc\r\n\0 (linelen = 5) -> linelen = 3になる
-            linelen--;
-        }
-        editorInsertRow(E.numrows, line, linelen);
-    }
-    // MEMO: EOFとエラーを区別したいときはferror(3)かfeof(3)を使うらしい
-    if (ferror(fp))
-        die("Unable to read line from file");
-    free(line);
-    fclose(fp);
-    E.dirty = 0;
+// 行atからn行が挿入されたので、後ろの行のマッチをずらして挿入された行を探す
+void editorFindRowsInserted(int at, int n) {
+    if (E.find_query == NULL)
+        return;
+    int i;
+    for (i = editorFindLowerBound(at, 0); i < E.find.n; i++)
+        E.find.m[i].row += n;
+    struct editorMatchList l = { NULL, 0, 0 };
+    editorFindScanRows(&l, at, at + n, E.find_rm);
+    int lo = editorFindLowerBound(at, 0);
+    editorFindSplice(lo, lo, l.m, l.n);
+    free(l.m);
 }
 
-void editorSave() {
-    if (E.filename == NULL) {
-        E.filename = editorPrompt("Save as: %s (ESC to cancel)", NULL);
-        if (E.filename == NULL) {
-            editorSetStatusMessage("Save aborted");
-            return;
-        }
+// 行atからn行が削除されたので、その行のマッチを消して後ろの行のマッチをずらす
+void editorFindRowsDeleted(int at, int n) {
+    if (E.find_query == NULL)
+        return;
+    int lo = editorFindLowerBound(at, 0);
+    editorFindSplice(lo, editorFindLowerBound(at + n, 0), NULL, 0);
+    int i;
+    for (i = lo; i < E.find.n; i++)
+        E.find.m[i].row -= n;
+}
+
+// カーソル位置から見て次 (direction = 1) か前 (-1) のマッチの添字 (無ければ-1)
+// 端まで行ったら反対側に戻る
+int editorFindNeighbor(int direction) {
+    if (E.find.n == 0)
+        return -1;
+    if (direction == 1) {
+        int i = editorFindLowerBound(E.cy, E.cx + 1);
+        return i == E.find.n ? 0 : i;
     }
+    int i = editorFindLowerBound(E.cy, E.cx) - 1;
+    return i < 0 ? E.find.n - 1 : i;
+}
 
-    // 1つの大きなバッファに文字列を作りファイルにそのまま書き込む
-    int len;
-    char *buf = editorRowsToString(&len);
+// カーソル位置にあるマッチの添字 (無ければ-1)
+int editorFindCurrent() {
+    int i = editorFindLowerBound(E.cy, E.cx);
+    if (i < E.find.n && E.find.m[i].row == E.cy && E.find.m[i].col == E.cx)
+        return i;
+    return -1;
+}
 
-    int fd = open(E.filename, O_RDWR | O_CREAT, 0644);
-    if (fd != -1) {
-        if (ftruncate(fd, len) != -1) {
-            if (write(fd, buf, len) == len) {
-                close(fd);
-                free(buf);
-                E.dirty = 0;
-                editorSetStatusMessage("%d bytes written to disk", len);
-                return;
-            }
-        }
-        close(fd);
+// 検索語を入力し終わった後に次・前のマッチに移動する
+void editorFindNext(int direction) {
+    if (E.find_query == NULL) {
+        editorSetStatusMessage("No search (Ctrl-/ to find)");
+        return;
     }
-    free(buf);
-    editorSetStatusMessage("Can't save! I/O error: %s", strerror(errno));
+    int i = editorFindNeighbor(direction);
+    if (i == -1) {
+        editorSetStatusMessage("Pattern not found: %s", E.find_query);
+        return;
+    }
+    E.cy = E.find.m[i].row;
+    E.cx = E.find.m[i].col;
 }
 
-/** find ***/
-
 void editorFindCallback(char *query, int key) {
-    static int last_match = -1; // the index of the row that the last match was on
-    static int direction = 1; // 1: forward, -1: backward
-
     // 以前マッチした箇所のマッチ前のハイライト
     static int saved_hl_line;
     static char *saved_hl = NULL;
 
     // 以前マッチしたものが存在すれば、その箇所のハイライトを元のものに復元する
     if (saved_hl) {
-        memcpy(E.row[saved_hl_line].hl, saved_hl, E.row[saved_hl_line].rsize);
+        // LRUで捨てられていたら作り直した時にハイライトも元に戻っている
+        erow *row = editorRow(saved_hl_line);
+        if (row->r)
+            memcpy(row->r->hl, saved_hl, row->r->rsize);
         free(saved_hl);
         saved_hl = NULL;
     }
 
+    int i;
     if (key == '\r' || key == '\x1b') {
         // reset state
-        last_match = -1;
-        direction = 1;
+        // Enterの場合は索引を残し、Ctrl-G/Ctrl-Tで次・前のマッチに移動できるようにする
+        if (key == '\x1b')
+            editorFindClear();
         return;
     } else if (key == ARROW_RIGHT || key == ARROW_DOWN) {
         // search forward
-        direction = 1;
+        i = editorFindNeighbor(1);
     } else if (key == ARROW_LEFT || key == ARROW_UP) {
         // search backward
-        direction = -1;
+        i = editorFindNeighbor(-1);
     } else {
-        // 検索ワードが変化した場合は前方検索に戻しつつstateをreset
-        last_match = -1;
-        direction = 1;
-    }
-
-    if (last_match == -1) direction = 1;
-    int current = last_match;
-    int i;
-    for (i = 0; i < E.numrows; i++) {
-        current += direction;
-
-        // search wrap
-        if (current == -1) current = E.numrows - 1; // 一番上にいったので一番下に移動
-        else if (current == E.numrows) current = 0; // 一番下にいったので一番上に移動
-
-        erow *row = &E.row[current];
-        char *match = strstr(row->render, query);
-        if (match) {
-            last_match = current;
-            E.cy = current;
-            // E.cy = i;
-            E.cx = editorRowRxToCx(row, match - row->render);
-            // 検索結果が画面の一番上になるように設定する
-            E.rowoff = E.numrows;
-
-            // ハイライト書き換える前の状態をstatic変数に保存しておく
-            saved_hl_line = current;
-            saved_hl = malloc(row->rsize);
-            memcpy(saved_hl, row->hl, row->rsize);
-
-            // マッチ箇所に色をつける
-            memset(&row->hl[match - row->render], HL_MATCH, strlen(query));
-            break;
+        // Ctrl-Xで正規表現での検索と切り替える (Ctrl-Rは置換なので使わない)
+        if (key == CTRL_KEY('x')) {
+            E.find_regex = !E.find_regex;
+            editorFindClear();
         }
+        // 検索ワードが変化した場合は索引を作り直し、先頭から探し直す
+        // (BackSpaceで検索語が短くなった時や正規表現に切り替えた時は、前のマッチより上の行にもマッチしうる)
+        // 後ろに1文字打った時は、全行を探し直さずに今の索引を絞り込む
+        editorFindBuild(query);
+        i = E.find.n > 0 ? 0 : -1;
     }
+    if (i == -1)
+        return;
+
+    struct editorMatch *m = &E.find.m[i];
+    erow *row = editorRowHighlighted(m->row);
+    E.cy = m->row;
+    E.cx = m->col;
+    // 検索結果が画面の一番上になるように設定する
+    E.rowoff = E.numrows;
+
+    // ハイライト書き換える前の状態をstatic変数に保存しておく
+    saved_hl_line = m->row;
+    saved_hl = malloc(row->r->rsize);
+    memcpy(saved_hl, row->r->hl, row->r->rsize);
+
+    // マッチ箇所に色をつける (タブを含む場合があるのでrender上の範囲に直す)
+    int rx = editorRowCxToRx(row, m->col);
+    memset(&row->r->hl[rx], HL_MATCH, editorRowCxToRx(row, m->col + m->len) - rx);
 }
 
 void editorFind() {
@@ -609,7 +4094,7 @@ void editorFind() {
     int saved_coloff = E.coloff;
     int saved_rowoff = E.rowoff;
 
-    char *query = editorPrompt("Search: %s (Use ESC/Arrows/Enter)", editorFindCallback);
+    char *query = editorPrompt("Search: %s (Use ESC/Arrows/Enter, Ctrl-X = regex)", editorFindCallback);
 
     if (query) {
         free(query);
@@ -622,44 +4107,186 @@ void editorFind() {
     }
 }
 
+/*** replace ***/
+
+// 置き換える行
+struct replaceRow {
+    int row;
+    int m;       // この行の最初のマッチ (E.find.mの添字)
+    int nm;      // この行のマッチの数
+    char *chars; // 置き換えた後の中身。メインスレッドがeditorSlabAllocで確保し、スレッドが埋める
+    int len;
+};
+
+// スレッド1つの受け持ち。置き換える行rows[0, n)
+struct replaceChunk {
+    pthread_t thread;
+    struct replaceRow *rows;
+    int n;
+    const char *with;
+    int withlen;
+};
+
+// 受け持ちの行の置き換えた後の中身を作る (スレッドで実行する)
+void *editorReplaceChunk(void *arg) {
+    struct replaceChunk *c = arg;
+    int i;
+    for (i = 0; i < c->n; i++) {
+        struct replaceRow *r = &c->rows[i];
+        erow *row = editorRow(r->row);
+        char *p = r->chars;
+        int prev = 0;
+        int k;
+        for (k = r->m; k < r->m + r->nm; k++) {
+            struct editorMatch *m = &E.find.m[k];
+            memcpy(p, &row->chars[prev], m->col - prev);
+            p += m->col - prev;
+            memcpy(p, c->with, c->withlen);
+            p += c->withlen;
+            prev = m->col + m->len;
+        }
+        memcpy(p, &row->chars[prev], row->size - prev);
+        r->chars[r->len] = '\0';
+    }
+    return NULL;
+}
+
+// queryの出現 (E.find_regexなら正規表現) をすべてwithに置き換え、置き換えた数を返す
+// 正しくない正規表現なら-1。置き換えた行数を*nrowsに入れる
+// 置き換える行ごとに新しい大きさのバッファを確保しておき、中身はスレッドで分けて作る
+// 作ったバッファはそのまま行のcharsにするので、各行は1回だけ書き換えてコピーもしない
+int editorReplaceAll(const char *query, const char *with, int *nrows) {
+    *nrows = 0;
+    editorFindBuild(query);
+    if (E.find.n == 0) {
+        int invalid = E.find_regex && E.find_re == NULL;
+        editorFindClear();
+        return invalid ? -1 : 0;
+    }
+
+    // 索引は行, 列の順なので、同じ行のマッチは並んでいる
+    int withlen = strlen(with);
+    struct replaceRow *rows = malloc(sizeof(struct replaceRow) * E.find.n);
+    if (rows == NULL) die("malloc");
+    int n = 0;
+    int i = 0;
+    while (i < E.find.n) {
+        struct replaceRow *r = &rows[n++];
+        r->row = E.find.m[i].row;
+        r->m = i;
+        r->len = editorRow(r->row)->size;
+        while (i < E.find.n && E.find.m[i].row == r->row) {
+            r->len += withlen - E.find.m[i].len;
+            i++;
+        }
+        r->nm = i - r->m;
+        r->chars = editorSlabAlloc(r->len + 1);
+    }
+
+    int nchunks = editorThreadCount(E.find.n / KILO_FIND_CHUNK);
+    struct replaceChunk chunks[KILO_THREADS];
+    int started[KILO_THREADS] = { 0 };
+    for (i = 0; i < nchunks; i++) {
+        int from = (long long)n * i / nchunks;
+        chunks[i].rows = &rows[from];
+        chunks[i].n = (long long)n * (i + 1) / nchunks - from;
+        chunks[i].with = with;
+        chunks[i].withlen = withlen;
+    }
+    for (i = 1; i < nchunks; i++)
+        started[i] = pthread_create(&chunks[i].thread, NULL, editorReplaceChunk, &chunks[i]) == 0;
+    editorReplaceChunk(&chunks[0]);
+    for (i = 1; i < nchunks; i++) {
+        if (started[i])
+            pthread_join(chunks[i].thread, NULL);
+        else
+            editorReplaceChunk(&chunks[i]);
+    }
+
+    for (i = 0; i < n; i++) {
+        struct replaceRow *r = &rows[i];
+        // 取り消しは全部の行をまとめて1回で戻す
+        erow *row = editorRow(r->row);
+        struct undoRecord *u = editorUndoPush(UNDO_DELETE, i > 0 ? UNDO_CHAIN : 0,
+            r->row, 0, row->chars, row->size);
+        u->endcol = row->size;
+        u = editorUndoPush(UNDO_INSERT, UNDO_CHAIN, r->row, 0, r->chars, r->len);
+        u->endcol = r->len;
+        editorJournalOp(UNDO_DELETE, 0, r->row, 0, r->row, row->size, row->chars, row->size);
+        editorJournalOp(UNDO_INSERT, 0, r->row, 0, r->row, r->len, r->chars, r->len);
+        editorRowSetChars(row, r->chars, r->len);
+        editorSyntaxInvalidate(r->row);
+    }
+    free(rows);
+    *nrows = n;
+
+    n = E.find.n;
+    editorFindClear();
+    E.dirty++;
+    if (E.cy < E.numrows && E.cx > editorRow(E.cy)->size)
+        E.cx = editorRow(E.cy)->size;
+    return n;
+}
+
+// 検索語 (最後の検索が正規表現ならそのモード) と置き換える文字列を聞いて、すべて置き換える
+void editorReplace() {
+    char *query = editorPrompt(E.find_regex ? "Replace regex: %s (ESC to cancel)"
+        : "Replace: %s (ESC to cancel)", NULL);
+    if (query == NULL)
+        return;
+    char *with = editorPrompt("Replace with: %s (ESC to cancel)", NULL);
+    if (with == NULL) {
+        free(query);
+        return;
+    }
+
+    int nrows;
+    int n = editorReplaceAll(query, with, &nrows);
+    if (n == -1)
+        editorSetStatusMessage("Invalid regex: %s", query);
+    else if (n == 0)
+        editorSetStatusMessage("Pattern not found: %s", query);
+    else
+        editorSetStatusMessage("Replaced %d occurrences in %d lines", n, nrows);
+    free(query);
+    free(with);
+}
+
 /*** append buffer ***/
 
 struct abuf {
     char *b;
     int len;
+    int cap; // bに確保しているバイト数
 };
 
-#define ABUF_INIT {NULL, 0}
+#define ABUF_INIT {NULL, 0, 0}
 
+// 足りない時は倍々で広げるので、細かく追加してもreallocは数回で済む
 void abAppend(struct abuf *ab, const char *s, int len) {
-    char *new = realloc(ab->b, ab->len + len);
-
-    if (new == NULL) return;
-    memcpy(&new[ab->len], s, len);
-    ab->b = new;
+    if (ab->len + len > ab->cap) {
+        int cap = ab->cap ? ab->cap : 4096;
+        while (cap < ab->len + len) cap *= 2;
+        char *new = realloc(ab->b, cap);
+        if (new == NULL) return;
+        ab->b = new;
+        ab->cap = cap;
+    }
+    memcpy(&ab->b[ab->len], s, len);
     ab->len += len;
 }
 
 void abAppendStr(struct abuf *ab, const char *s) {
-    int len;
-    len = strlen(s);
-    char *new = realloc(ab->b, ab->len + len);
-
-    if (new == NULL) return;
-    memcpy(&new[ab->len], s, len);
-    ab->b = new;
-    ab->len += len;
+    abAppend(ab, s, strlen(s));
 }
 
 void abFree(struct abuf *ab) {
     free(ab->b);
 }
 
-// writeFd にwrite(2)してバッファを再初期化する
+// writeFd にwrite(2)してバッファを空にする (確保した領域は次回も使い回す)
 void abFlush(struct abuf *ab, int writeFd) {
     write(writeFd, ab->b, ab->len);
-    abFree(ab);
-    ab->b = NULL;
     ab->len = 0;
 }
 
@@ -667,7 +4294,7 @@ void abFlush(struct abuf *ab, int writeFd) {
 void editorScroll() {
     E.rx = 0;
     if (E.cy < E.numrows) {
-        E.rx = editorRowCxToRx(&E.row[E.cy], E.cx); // タブ文字などを考慮したカーソル位置をcxから作る
+        E.rx = editorRowCxToRx(editorRow(E.cy), E.cx); // タブ文字などを考慮したカーソル位置をcxから作る
     }
 
     /* # 垂直スクロール */
@@ -693,9 +4320,28 @@ void editorScroll() {
     }
 }
 
-void editorDrawRows(struct abuf *ab) {
+// 画面1行分のセルを返す
+char *editorFrameChars(struct editorFrame *f, int y) {
+    return &f->chars[y * E.screencols];
+}
+
+unsigned char *editorFrameHl(struct editorFrame *f, int y) {
+    return &f->hl[y * E.screencols];
+}
+
+void editorFrameClearRow(struct editorFrame *f, int y, int hl) {
+    memset(editorFrameChars(f, y), ' ', E.screencols);
+    memset(editorFrameHl(f, y), hl, E.screencols);
+}
+
+// ファイルの内容を今回のフレームに書く (端末にはまだ出力しない)
+void editorDrawRows() {
     int y;
     for (y = 0; y < E.screenrows; y++) {
+        char *c = editorFrameChars(&E.frame, y);
+        unsigned char *hl = editorFrameHl(&E.frame, y);
+        editorFrameClearRow(&E.frame, y, HL_NORMAL);
+
         int filerow = y + E.rowoff;
         if (filerow >= E.numrows) {
             // ファイル行数以上のターミナル行数があった場合は ~文字を左に出力
@@ -709,102 +4355,178 @@ void editorDrawRows(struct abuf *ab) {
 
                 // welcomeメッセージ左の空白部分を作る
                 int padding = (E.screencols - welcomelen) / 2;
-                if (padding) {
-                    abAppend(ab, "~", 1);
-                    padding--;
-                }
-                while (padding--) abAppend(ab, " ", 1);
-                abAppend(ab, welcome, welcomelen);
+                if (padding) c[0] = '~';
+                memcpy(&c[padding], welcome, welcomelen);
             } else {
-                abAppend(ab, "~", 1);
+                c[0] = '~';
             }
         } else {
             // ファイル内容をスクリーンに出力
-            int len = E.row[filerow].rsize - E.coloff; // 水平スクロールのため調整
+            erender *r = editorRowHighlighted(filerow)->r;
+            int len = r->rsize - E.coloff; // 水平スクロールのため調整
             if (len < 0) len = 0;
             // 行の横幅がスクリーンを超えていたら切り詰める
             if (len > E.screencols) len = E.screencols;
 
-            char *c = &E.row[filerow].render[E.coloff]; // 水平スクロールのためcoloff文ずらして表示
-            unsigned char *hl = &E.row[filerow].hl[E.coloff];
-            int current_color = -1; // 現在の色のステート -1は色未設定
-            int j;
-            for (j = 0; j < len; j++) {
-                if (hl[j] == HL_NORMAL) {
-                    if (current_color != -1) {
-                        // 色が設定されていたらreset
-                        abAppend(ab, "\x1b[39m", 5); // reset to normal color: ESC[39m
-                        current_color = -1;
-                    }
-                    abAppend(ab, &c[j], 1);
-                } else {
-                    // ANSIエスケープシーケンスでテキストに色を付ける
-                    // ref: https://en.wikipedia.org/wiki/ANSI_escape_code#SGR_(Select_Graphic_Rendition)_parameters
-                    int color = editorSyntaxToColor(hl[j]);
-                    if (color != current_color) {
-                        // 色が違う時だけエスケープシーケンスを送る
-                        current_color = color;
-                        char buf[16];
-                        int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", color); // 8 color: ESC3[0-7]m
-                        abAppend(ab, buf, clen);
-                        // abAppendStr(ab, "\x1b[38;5;219m"); // 256colorは ESC[38;5;Nm で Nのところに0-255の数値を入れる
-                    }
-                    abAppend(ab, &c[j], 1);
-                }
-            }
-            abAppend(ab, "\x1b[39m", 5); // reset color
+            // 水平スクロールのためcoloff文ずらして表示
+            memcpy(c, &r->render[E.coloff], len);
+            memcpy(hl, &r->hl[E.coloff], len);
         }
-
-        // カーソルの右側を削除 : EL – Erase In Line
-        abAppend(ab, "\x1b[K", 3);
-
-        // 最後の行以外は改行を入れる
-        abAppend(ab, "\r\n", 2);
-        // TODO: delete
-        // abFlush(ab, 1);
     }
 }
 
-void editorDrawStatusBar(struct abuf *ab) {
+void editorDrawStatusBar() {
+    int y = E.screenrows;
+    char *c = editorFrameChars(&E.frame, y);
     // 色を反転 (背景)
-    // SGR – Select Graphic Rendition
-    // 7 	Negative (reverse) image
-    abAppend(ab, "\x1b[7m", 4);
+    editorFrameClearRow(&E.frame, y, HL_STATUSBAR);
+
     char status[80], rstatus[80];
     // ファイル名と行数を描画
     int len = snprintf(status, sizeof(status), "%.20s - %d lines %s",
         E.filename ? E.filename : "[No Name]", E.numrows,
         E.dirty ? "(modified)" : "");
 
-    int rlen = snprintf(rstatus, sizeof(rstatus), "%d/%d",
-        E.cy + 1, E.numrows);
-    if (len > E.screencols)
-        len = E.screenrows;
-    abAppend(ab, status, len);
-
-    // 残りのスペースを埋める
-    while (len < E.screencols) {
-        // 右端に位置していた場合に編集行の情報を描画
-        if (E.screencols - len == rlen) {
-            abAppend(ab, rstatus, rlen);
-            break;
-        } else {
-            abAppend(ab, " ", 1);
-            len++;
-        }
+    int rlen;
+    if (E.find_query && E.find_regex && E.find_re == NULL) {
+        rlen = snprintf(rstatus, sizeof(rstatus), "invalid regex | %d/%d",
+            E.cy + 1, E.numrows);
+    } else if (E.find_query) {
+        // 全件検索の結果を出す
+        const char *mode = E.find_regex ? "regex " : "";
+        int i = editorFindCurrent();
+        if (i != -1)
+            rlen = snprintf(rstatus, sizeof(rstatus), "%smatch %d of %d | %d/%d",
+                mode, i + 1, E.find.n, E.cy + 1, E.numrows);
+        else
+            rlen = snprintf(rstatus, sizeof(rstatus), "%s%d matches | %d/%d",
+                mode, E.find.n, E.cy + 1, E.numrows);
+    } else {
+        rlen = snprintf(rstatus, sizeof(rstatus), "%s | %d/%d",
+            E.syntax ? E.syntax->filetype : "no ft", E.cy + 1, E.numrows);
     }
-    // 戻す
-    abAppend(ab, "\x1b[m", 3);
-    abAppend(ab, "\r\n", 2);
+    if (len > E.screencols)
+        len = E.screencols;
+    memcpy(c, status, len);
+
+    // 右端に入りきる場合は編集行の情報を描画
+    if (len + rlen <= E.screencols)
+        memcpy(&c[E.screencols - rlen], rstatus, rlen);
 }
 
-void editorDrawMessageBar(struct abuf *ab) {
-    abAppend(ab, "\x1b[K", 3);
+void editorDrawMessageBar() {
+    int y = E.screenrows + 1;
+    editorFrameClearRow(&E.frame, y, HL_NORMAL);
     int msglen = strlen(E.statusmsg);
     if (msglen > E.screencols)
         msglen = E.screencols;
     if (msglen && time(NULL) - E.statusmsg_time < 5) // msgが入ってから5秒未満しか経過してないなら描画する
-        abAppend(ab, E.statusmsg, msglen);
+        memcpy(editorFrameChars(&E.frame, y), E.statusmsg, msglen);
+}
+
+// UTF-8の複数バイト文字や制御文字を含まない行か
+// 含む場合は1バイト = 1セルにならないので、行の途中からは描き直せない
+int editorFrameRowIsPlain(const char *c) {
+    int x;
+    for (x = 0; x < E.screencols; x++) {
+        unsigned char ch = c[x];
+        if (ch < 0x20 || ch >= 0x7f) return 0;
+    }
+    return 1;
+}
+
+// 画面のy行目を前回のフレームと比べ、変わったセルだけを出力する
+void editorFlushRow(struct abuf *ab, int y) {
+    char *c = editorFrameChars(&E.frame, y);
+    unsigned char *hl = editorFrameHl(&E.frame, y);
+    char *pc = editorFrameChars(&E.prev, y);
+    unsigned char *phl = editorFrameHl(&E.prev, y);
+
+    int x0 = 0;
+    int x1 = E.screencols - 1;
+    if (E.prev_valid) {
+        while (x0 < E.screencols && c[x0] == pc[x0] && hl[x0] == phl[x0]) x0++;
+        if (x0 == E.screencols)
+            return; // 変化なし
+        while (c[x1] == pc[x1] && hl[x1] == phl[x1]) x1--;
+        if (!editorFrameRowIsPlain(c) || !editorFrameRowIsPlain(pc)) {
+            x0 = 0;
+            x1 = E.screencols - 1;
+        }
+    }
+
+    // 末尾の空白まで変わっている場合は空白を送らずにEL (ESC[K) で消す
+    int trail = E.screencols;
+    while (trail > x0 && c[trail - 1] == ' ' && hl[trail - 1] == HL_NORMAL) trail--;
+    int end = x1 + 1;
+    int erase = 0;
+    if (end > trail) {
+        end = trail;
+        erase = 1;
+    }
+
+    // カーソル位置を変わった所に移動 : CUP – Cursor Position
+    char buf[32];
+    int clen = snprintf(buf, sizeof(buf), "\x1b[%d;%dH", y + 1, x0 + 1);
+    abAppend(ab, buf, clen);
+
+    // 同じ色が続く所はまとめて1回で追加する
+    int colored = 0;
+    int x = x0;
+    while (x < end) {
+        int run = x + 1;
+        while (run < end && hl[run] == hl[x]) run++;
+
+        if (hl[x] == HL_NORMAL) {
+            if (colored) {
+                // 色が設定されていたらreset
+                abAppend(ab, "\x1b[m", 3);
+                colored = 0;
+            }
+        } else {
+            // ANSIエスケープシーケンスでテキストに色を付ける (他の属性を消してから色を付ける)
+            // ref: https://en.wikipedia.org/wiki/ANSI_escape_code#SGR_(Select_Graphic_Rendition)_parameters
+            int elen;
+            const char *esc = editorSyntaxToEscape(hl[x], &elen);
+            abAppend(ab, esc, elen);
+            colored = 1;
+        }
+        abAppend(ab, &c[x], run - x);
+        x = run;
+    }
+    if (colored)
+        abAppend(ab, "\x1b[m", 3); // reset color
+
+    // カーソルの右側を削除 : EL – Erase In Line
+    if (erase)
+        abAppend(ab, "\x1b[K", 3);
+}
+
+// 縦スクロールした分は端末のスクロール機能で動かし、前回のフレームも同じだけずらす
+// 新しく見えるようになった行だけを描けばよくなる
+void editorFlushScroll(struct abuf *ab) {
+    int d = E.rowoff - E.prev_rowoff;
+    if (!E.prev_valid || d == 0 || E.coloff != E.prev_coloff)
+        return;
+    if (d >= E.screenrows || -d >= E.screenrows)
+        return;
+
+    // スクロール領域をテキスト部分に限定 : DECSTBM – Set Top and Bottom Margins
+    // 上に送る : SU – Scroll Up  ESC [ Pn S, 下に送る : SD – Scroll Down  ESC [ Pn T
+    char buf[32];
+    int len = snprintf(buf, sizeof(buf), "\x1b[1;%dr\x1b[%d%c\x1b[r",
+        E.screenrows, d > 0 ? d : -d, d > 0 ? 'S' : 'T');
+    abAppend(ab, buf, len);
+
+    int n = E.screenrows - (d > 0 ? d : -d); // 画面に残る行数
+    int from = d > 0 ? d : 0;
+    int to = d > 0 ? 0 : -d;
+    memmove(editorFrameChars(&E.prev, to), editorFrameChars(&E.prev, from), n * E.screencols);
+    memmove(editorFrameHl(&E.prev, to), editorFrameHl(&E.prev, from), n * E.screencols);
+    int y;
+    for (y = 0; y < E.screenrows; y++)
+        if (y < to || y >= to + n)
+            editorFrameClearRow(&E.prev, y, HL_NORMAL); // 端末側では空行になっている
 }
 
 // @see: https://vt100.net/docs/vt100-ug/chapter3.html
@@ -812,37 +4534,49 @@ void editorDrawMessageBar(struct abuf *ab) {
 void editorRefreshScreen() {
     editorScroll();
 
-    struct abuf ab = ABUF_INIT;
-    // struct abuf ab = { .b = NULL, .len = 0 };
+    // 今回のフレームを作る
+    editorDrawRows();
+    editorDrawStatusBar();
+    editorDrawMessageBar();
+
+    // 前回のフレームとの差分だけを送る
+    // バッファはフレームをまたいで使い回すので、毎回reallocし直さない
+    static struct abuf ab = ABUF_INIT;
     // The \x1b is the ASCII escape character (hexadecimal value 0x1b = ESC)
     // \xXX で1バイト
-    // カーソルを隠す : RM – Reset Mode
+    // 描画中はカーソルを隠す : RM – Reset Mode
     // ESC [ Ps ; Ps ; . . . ; Ps l 	default value: none
     // 25 = cursor
-    // TODO: 戻す
     abAppend(&ab, "\x1b[?25l", 6);
-    // // コンソール全体をクリア : ED – Erase In Display
-    // abAppend(&ab, "\x1b[2J", 4);
-    // カーソルを左上に移動 : CUP – Cursor Position
-    abAppend(&ab, "\x1b[H", 3);
-
-    editorDrawRows(&ab);
-    editorDrawStatusBar(&ab);
-    editorDrawMessageBar(&ab);
+    editorFlushScroll(&ab);
+    int y;
+    for (y = 0; y < E.screenrows + 2; y++)
+        editorFlushRow(&ab, y);
+    int drawn = ab.len > 6;
+    if (!drawn)
+        ab.len = 0; // カーソルが動いただけ
 
     // カーソル位置を現在の位置に移動
     char buf[32];
-    snprintf(buf, sizeof(buf), "\x1b[%d;%dH", (E.cy - E.rowoff) + 1,
-                                              (E.rx - E.coloff) + 1); // VT100は1から始まる
-    abAppend(&ab, buf, strlen(buf));
-
-    // カーソルを表示 : SM – Set Mode
-    // ESC [ Ps ; . . . ; Ps h 	default value: none
-    abAppend(&ab, "\x1b[?25h", 6);
+    int len = snprintf(buf, sizeof(buf), "\x1b[%d;%dH", (E.cy - E.rowoff) + 1,
+                                                        (E.rx - E.coloff) + 1); // VT100は1から始まる
+    abAppend(&ab, buf, len);
+
+    if (drawn) {
+        // カーソルを表示 : SM – Set Mode
+        // ESC [ Ps ; . . . ; Ps h 	default value: none
+        abAppend(&ab, "\x1b[?25h", 6);
+    }
 
-    write(STDOUT_FILENO, ab.b, ab.len);
+    abFlush(&ab, STDOUT_FILENO);
 
-    abFree(&ab);
+    // 今回のフレームを次回の比較対象にする
+    struct editorFrame tmp = E.prev;
+    E.prev = E.frame;
+    E.frame = tmp;
+    E.prev_valid = 1;
+    E.prev_rowoff = E.rowoff;
+    E.prev_coloff = E.coloff;
 }
 
 void editorSetStatusMessage(const char *fmt, ...) {
@@ -867,7 +4601,9 @@ char *editorPrompt(char *prompt, void (*callback)(char *, int)) {
         editorSetStatusMessage(prompt, buf);
         editorRefreshScreen();
 
+        E.prompting = 1;
         int c = editorReadKey();
+        E.prompting = 0;
         if (c == DEL_KEY || c == CTRL_KEY('h') || c == BACKSPACE) {
             // 消せるようにする
             if (buflen != 0) buf[--buflen] = '\0';
@@ -884,6 +4620,18 @@ char *editorPrompt(char *prompt, void (*callback)(char *, int)) {
                 if (callback) callback(buf, c);
                 return buf;
             }
+        } else if (c == PASTE) {
+            // 貼り付けは1行目の表示できる文字だけ追加する
+            size_t j;
+            for (j = 0; j < E.pastelen && E.paste[j] != '\r' && E.paste[j] != '\n'; j++) {
+                if (iscntrl((unsigned char)E.paste[j])) continue;
+                if (buflen == bufsize - 1) {
+                    bufsize *= 2;
+                    buf = realloc(buf, bufsize);
+                }
+                buf[buflen++] = E.paste[j];
+            }
+            buf[buflen] = '\0';
         } else if (!iscntrl(c) && c < 128) { // if ASCII character (except control character)
             // ASCII文字ならバッファに追加
             if (buflen == bufsize - 1) { // バッファが足らなかったら再確保
@@ -900,7 +4648,7 @@ char *editorPrompt(char *prompt, void (*callback)(char *, int)) {
 
 void editorMoveCursor(int key) {
     // カーソル位置にある行を表す構造体を取得 (末尾の場合はNULL)
-    erow *row = (E.cy >= E.numrows) ? NULL : &E.row[E.cy];
+    erow *row = (E.cy >= E.numrows) ? NULL : editorRow(E.cy);
     switch (key) {
     case ARROW_LEFT:
     case CTRL_KEY('b'):
@@ -908,7 +4656,7 @@ void editorMoveCursor(int key) {
             E.cx--;
         } else if (E.cy > 0) { // カーソルが行頭かつ先頭行以外の場合は前の行の末尾に移動
             E.cy--;
-            E.cx = E.row[E.cy].size;
+            E.cx = editorRow(E.cy)->size;
         }
         break;
     case ARROW_RIGHT:
@@ -935,7 +4683,7 @@ void editorMoveCursor(int key) {
 
 
     // 長い行から上下にスクロールされた時にカーソル位置が行のサイズを超えることがあるので、その場合に行の末尾に補正する
-    row = (E.cy >= E.numrows) ? NULL : &E.row[E.cy];
+    row = (E.cy >= E.numrows) ? NULL : editorRow(E.cy);
     int rowlen = row ? row->size : 0; // ファイル末尾の場合一番左にカーソルを強制的に移動
     if (E.cx > rowlen) {
         E.cx = rowlen;
@@ -952,12 +4700,18 @@ void editorProcessKeypress() {
         editorInsertNewLine();
         break;
     case CTRL_KEY('q'):
+        if (E.save) {
+            editorSetStatusMessage("Waiting for save to finish...");
+            editorRefreshScreen();
+            editorSaveWait();
+        }
         if (E.dirty && quit_times > 0) {
             editorSetStatusMessage("WARNING!!! File has unsaved changes. "
                 "Press Ctrl-Q %d more times to quit.", quit_times);
             quit_times--;
             return;
         }
+        editorJournalRemove();
         exit(0);
         break;
 
@@ -965,6 +4719,10 @@ void editorProcessKeypress() {
         editorSave();
         break;
 
+    case CTRL_KEY('r'):
+        editorReplace();
+        break;
+
     case ARROW_UP:
     case CTRL_KEY('p'):
     case ARROW_DOWN:
@@ -984,7 +4742,7 @@ void editorProcessKeypress() {
     case END_KEY:
     case CTRL_KEY('e'):
         if (E.cy < E.numrows)
-            E.cx = E.row[E.cy].size;
+            E.cx = editorRow(E.cy)->size;
         break;
 
     case CTRL_KEY('_'): // CTRL-fだとカーソルと被るので"/"に変更
@@ -1015,8 +4773,37 @@ void editorProcessKeypress() {
         }
         break;
 
+    case PASTE:
+        if (E.pastelen > 0) {
+            int row = E.cy, col = E.cx;
+            int newrow = E.cy == E.numrows;
+            editorInsertText(E.paste, E.pastelen);
+            editorUndoInsert(row, col, newrow, E.paste, E.pastelen);
+        }
+        break;
+
+    case CTRL_KEY('z'):
+        editorUndo();
+        break;
+
+    case CTRL_KEY('y'):
+        editorRedo();
+        break;
+
     case CTRL_KEY('l'):
+        E.prev_valid = 0; // 画面を全部描き直す
+        break;
+
+    case CTRL_KEY('g'): // 次のマッチ
+        editorFindNext(1);
+        break;
+
+    case CTRL_KEY('t'): // 前のマッチ
+        editorFindNext(-1);
+        break;
+
     case '\x1b':
+        editorFindClear(); // 検索結果の表示をやめる
         break;
 
     default:
@@ -1037,13 +4824,51 @@ void initEditor() {
     E.coloff = 0;
     E.numrows = 0;
     E.row = NULL;
+    E.rowcap = 0;
+    E.gap = 0;
+    E.lru_head = NULL;
+    E.lru_tail = NULL;
+    E.nrendered = 0;
+    E.map = NULL;
+    E.maplen = 0;
+    E.mappage = 0;
+    E.mapcut = 0;
+    E.maptruncated = 0;
     E.dirty = 0;
+    E.save = NULL;
+    E.savegen = 0;
+    E.prompting = 0;
+    E.find_query = NULL;
+    E.find_qlen = 0;
+    E.find_regex = 0;
+    E.find_re = NULL;
+    E.find_rm = NULL;
+    E.undo.rec = NULL;
+    E.undo.n = 0;
+    E.undo.cap = 0;
+    E.undo.cur = 0;
+    E.undo.arena = NULL;
+    E.journal = NULL;
+    E.syntax = NULL;
+    E.hl_frontier = 0;
+    E.find.m = NULL;
+    E.find.n = 0;
+    E.find.cap = 0;
     E.filename = NULL;
     E.statusmsg[0] = '\0';
     E.statusmsg_time = 0;
 
     if (getWindowSize(&E.screenrows, &E.screencols) == -1) die("getWindowSize");
     E.screenrows -= 2;
+
+    int cells = (E.screenrows + 2) * E.screencols;
+    E.frame.chars = malloc(cells);
+    E.frame.hl = malloc(cells);
+    E.prev.chars = malloc(cells);
+    E.prev.hl = malloc(cells);
+    E.prev_valid = 0;
+
+    editorSyntaxStart();
 }
 
 void debugScreen() {
@@ -1061,14 +4886,42 @@ int main(int argc, char *argv[]) {
         editorOpen(argv[1]);
     }
 
-    editorSetStatusMessage("HELP: Ctrl-S = save | Ctrl-Q = quit | Ctrl-/ = find");
-
+    editorSetStatusMessage("HELP: ^S save ^Q quit | ^/ find ^G/^T next/prev ^R replace | ^Z/^Y undo/redo");
+    editorJournalOpen();
+
+    // 環境変数KILO_FPSがあれば描画回数の上限をそれにする (1から1000まで。それ以外は無視する)
+    int fps = KILO_MAX_FPS;
+    const char *env = getenv("KILO_FPS");
+    if (env) {
+        char *end;
+        long v = strtol(env, &end, 10);
+        if (end != env && *end == '\0' && v >= 1 && v <= 1000)
+            fps = v;
+    }
+    int interval = 1000 / fps;
     while (1) {
+        // 開いているファイルが切り詰められていたら、読めなくなる前に行をコピーしておく
+        editorMapCheck();
         // スクリーンに文字を描画
         editorRefreshScreen();
+        long long frame = editorNowMs();
         // debugScreen();
         // キーを待ち受け
         editorProcessKeypress();
+
+        // 既に届いている入力 (貼り付けやキーリピート) は描画せずにまとめて処理する
+        // 前の描画から間隔が空いていない時はその分だけ次の入力を待つ
+        // 入力が途切れなくてもintervalごとには描画する
+        long long batch = editorNowMs();
+        while (1) {
+            long long now = editorNowMs();
+            if (now - batch >= interval)
+                break;
+            int wait = frame + interval - now;
+            if (!editorInputPending(wait > 0 ? wait : 0))
+                break;
+            editorProcessKeypress();
+        }
     }
     return 0;
 }
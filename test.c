@@ -0,0 +1,255 @@
+/*** includes ***/
+
+// kiloのテスト (make test)
+// kilo.cをそのまま取り込み、端末を使わずにランダムな編集を繰り返して、編集位置の辺りだけを
+// 作り直しているもの (render, hl, hl_oc, 検索の索引, 取り消しの記録) が、
+// charsから全部作り直したものと同じになっているかを調べる
+// 使い方: ./kilo-test [回数]  (回数は乱数の種の数。既定は200)
+
+#define _DEFAULT_SOURCE
+#define _BSD_SOURCE
+#define _GNU_SOURCE
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/*** hooks ***/
+
+// 端末が無くても動くよう、ウィンドウサイズは固定の大きさを返す
+int testWindowSize(struct winsize *ws) {
+    ws->ws_row = 24;
+    ws->ws_col = 80;
+    return 0;
+}
+
+#define ioctl(fd, req, ws) testWindowSize(ws)
+#define main kiloMain
+
+#undef _DEFAULT_SOURCE // kilo.cが定義し直す
+#include "kilo.c"
+
+#undef ioctl
+#undef main
+
+/*** test ***/
+
+int test_seed;
+int test_step;
+
+void testFail(const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    printf("seed %d step %d: ", test_seed, test_step);
+    vprintf(fmt, ap);
+    printf("\n");
+    va_end(ap);
+    exit(1);
+}
+
+// 行のrenderとhlを、編集の経緯を使わずにcharsから作る (行頭の状態はin)。行末の状態を返す
+int testRender(erow *row, int in, char *render, unsigned char *hl, int *rsize) {
+    unsigned char *chl = malloc(row->size + 1);
+    if (chl == NULL) die("malloc");
+    int oc = 0;
+    if (E.syntax)
+        oc = editorSyntaxScan(row->chars, row->size, in, chl);
+    else
+        memset(chl, HL_NORMAL, row->size);
+    int rx = 0;
+    int k;
+    for (k = 0; k < row->size; k++) {
+        int next = editorRenderAdvance(rx, row->chars[k]);
+        for (; rx < next; rx++) {
+            render[rx] = row->chars[k] == '\t' ? ' ' : row->chars[k];
+            hl[rx] = chl[k];
+        }
+    }
+    *rsize = rx;
+    free(chl);
+    return oc;
+}
+
+// 全行のrender, hl, hl_ocと検索の索引を作り直したものと比べる
+// 比べた後は全行のrenderを作っておき、次の編集ではそれを編集位置の辺りだけ直させる
+void testCheck() {
+    editorSyntaxAdvance(E.numrows);
+    int in = 0;
+    int j;
+    for (j = 0; j < E.numrows; j++) {
+        erow *row = editorRow(j);
+        char *render = malloc(row->size * KILO_TAB_STOP + 1);
+        unsigned char *hl = malloc(row->size * KILO_TAB_STOP + 1);
+        if (render == NULL || hl == NULL) die("malloc");
+        int rsize;
+        int oc = testRender(row, in, render, hl, &rsize);
+        if (row->hl_oc != oc)
+            testFail("row %d: hl_oc %d, expected %d", j, row->hl_oc, oc);
+        erender *r = row->r;
+        if (r) {
+            if (r->rsize != rsize || memcmp(r->render, render, rsize) != 0)
+                testFail("row %d: render \"%.*s\", expected \"%.*s\"", j, r->rsize, r->render, rsize, render);
+            if (memcmp(r->hl, hl, rsize) != 0)
+                testFail("row %d: hl differs", j);
+            int tabs = memchr(row->chars, '\t', row->size) != NULL;
+            if (((row->flags & ROW_RENDER_CHARS) != 0) == tabs || ((row->flags & ROW_RENDER_CHARS) && r->render != row->chars))
+                testFail("row %d: render %s chars", j, tabs ? "shares" : "doesn't share");
+        }
+        free(render);
+        free(hl);
+        in = oc;
+    }
+    for (j = 0; j < E.numrows; j++)
+        editorRowHighlighted(j);
+
+    if (E.find_query) {
+        struct editorMatchList l = { NULL, 0, 0 };
+        for (j = 0; j < E.find.n; j++)
+            editorMatchPush(&l, E.find.m[j].row, E.find.m[j].col, E.find.m[j].len);
+        char *query = strdup(E.find_query);
+        editorFindClear();
+        editorFindBuild(query);
+        if (l.n != E.find.n || (l.n > 0 && memcmp(l.m, E.find.m, sizeof(struct editorMatch) * l.n) != 0))
+            testFail("search index for \"%s\": %d matches, expected %d", query, l.n, E.find.n);
+        free(query);
+        free(l.m);
+    }
+}
+
+// バッファの中身を改行で繋いだ文字列
+char *testDump() {
+    size_t len = 0;
+    int j;
+    for (j = 0; j < E.numrows; j++)
+        len += editorRow(j)->size + 1;
+    char *s = malloc(len + 1);
+    if (s == NULL) die("malloc");
+    char *p = s;
+    for (j = 0; j < E.numrows; j++) {
+        erow *row = editorRow(j);
+        memcpy(p, row->chars, row->size);
+        p += row->size;
+        *p++ = '\n';
+    }
+    *p = '\0';
+    return s;
+}
+
+// 入力する文字列。コメント・文字列・数値・キーワード・タブの境目ができやすいものを選ぶ
+const char *test_tokens[] = {
+    "a", "b", " ", "\t", "/", "*", "\"", "'", "\\", "1", ".", "(",
+    "int", "if", "/*", "*/", "//", "\"x\"", "0x1f", "ab", "\tab", "a\nb", "*/\n/*", "\n\t",
+};
+
+#define TEST_TOKENS (sizeof(test_tokens) / sizeof(test_tokens[0]))
+
+// 貼り付け (editorProcessKeypressのPASTEと同じ)
+void testPaste(const char *s) {
+    int row = E.cy, col = E.cx;
+    int newrow = E.cy == E.numrows;
+    editorInsertText(s, strlen(s));
+    editorUndoInsert(row, col, newrow, s, strlen(s));
+}
+
+// 1つの乱数の種で編集を繰り返す
+void testSession(int seed) {
+    srand(seed);
+    E.filename = strdup(seed % 4 == 3 ? "test.txt" : "test.c");
+    editorSelectSyntaxHighlight();
+    const char *init[] = { "int main() {", "\t/* comment", "\tstill */ return 0;", "}" };
+    unsigned int i;
+    for (i = 0; i < sizeof(init) / sizeof(init[0]); i++)
+        editorInsertRow(E.numrows, (char *)init[i], strlen(init[i]));
+    char *first = testDump();
+    if (seed % 2)
+        editorFindBuild("ab");
+    testCheck();
+
+    for (test_step = 0; test_step < 300; test_step++) {
+        if (rand() % 3 == 0) {
+            E.cy = rand() % (E.numrows + 1);
+            E.cx = E.cy < E.numrows ? rand() % (editorRow(E.cy)->size + 1) : 0;
+        }
+        int op = rand() % 20;
+        const char *t = test_tokens[rand() % TEST_TOKENS];
+        if (op < 8) {
+            for (; *t; t++) {
+                if (*t == '\n')
+                    editorInsertNewLine();
+                else
+                    editorInsertChar(*t);
+            }
+        } else if (op < 10) {
+            testPaste(t);
+        } else if (op < 12) {
+            editorInsertNewLine();
+        } else if (op < 16) {
+            editorDelChar();
+        } else if (op < 18) {
+            editorUndo();
+        } else if (op < 19) {
+            editorRedo();
+        } else {
+            int nrows;
+            editorReplaceAll("ab", "b\ta", &nrows);
+            if (seed % 2)
+                editorFindBuild("ab");
+        }
+        testCheck();
+    }
+
+    // 全部取り消すと最初の中身に、全部やり直すと一番新しい中身に戻る
+    while (E.undo.cur < E.undo.n)
+        editorRedo();
+    testCheck();
+    char *last = testDump();
+    while (E.undo.cur > 0)
+        editorUndo();
+    char *s = testDump();
+    if (strcmp(s, first) != 0)
+        testFail("undo all: \"%s\", expected \"%s\"", s, first);
+    free(s);
+    testCheck();
+    while (E.undo.cur < E.undo.n)
+        editorRedo();
+    s = testDump();
+    if (strcmp(s, last) != 0)
+        testFail("redo all: \"%s\", expected \"%s\"", s, last);
+    free(s);
+    testCheck();
+    free(first);
+    free(last);
+}
+
+/*** main ***/
+
+// 子プロセスで新しいエディタの状態から実行する
+int main(int argc, char *argv[]) {
+    int n = argc > 1 ? atoi(argv[1]) : 200;
+    int failed = 0;
+    int seed;
+    for (seed = 1; seed <= n; seed++) {
+        fflush(stdout);
+        pid_t pid = fork();
+        if (pid == -1) die("fork");
+        if (pid == 0) {
+            test_seed = seed;
+            initEditor();
+            testSession(seed);
+            exit(0);
+        }
+        int status;
+        if (waitpid(pid, &status, 0) == -1) die("waitpid");
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            if (!WIFEXITED(status))
+                printf("seed %d: killed by signal %d\n", seed, WTERMSIG(status));
+            failed++;
+        }
+    }
+    printf("%d/%d sessions ok\n", n - failed, n);
+    return failed != 0;
+}